@@ -1,138 +1,311 @@
 #include "DirectedGraphScanner.h"
 #include "cv.h" // OpenCV API
-#include "kdtree.hpp"
 #include "MyTime.h"
 #include <map>
 
 namespace TopCodes {
 
+// Neighbors looked at for each code
+static const int NNEIGHBORS=8;
+// Rebuild the whole graph when more than 1/REBUILD_FRACTION of the codes changed
+static const int REBUILD_FRACTION=4;
+// What happened to a code since the previous scan
+enum { UNCHANGED, ADDED, MOVED, NEAR_CHANGE };
+
 DirectedGraphScanner::DirectedGraphScanner()
    : mGraph(NULL),
-mMemStorage(NULL){
+mMemStorage(NULL),
+mIncremental(false),
+mSearchRadius(0) {
 	   Scanner::setCodeFactory(new CvGraphCodeFactory);
+	   mChanges.rebuilt = false;
 }
 DirectedGraphScanner::~DirectedGraphScanner() {
 	clear();
 }
 
-struct P2 {
-    double x,y;
-    int    code;
-    CvGraphCode *mycode;
-    P2(double _x=0.0, double _y=0.0): x(_x),y(_y),code(NULL){}
-};
-
 std::vector<Code*>
 DirectedGraphScanner::scan(	const Image  *image,
 							ScanListener *l,
 							Image        *annotate) {
-	clear();
+	if (!mIncremental)
+		clear();
 	std::vector<Code*> topcode_codes = Scanner::scan(image, l);
-	if (topcode_codes.empty())
+	mChanges.added.clear();
+	mChanges.removed.clear();
+	mChanges.moved.clear();
+	mChanges.rewired.clear();
+	mChanges.rebuilt = false;
+	if (topcode_codes.empty()) {
+		for (size_t n=0; n<mNodes.size(); ++n)
+			mChanges.removed.push_back(mNodes[n].vtx);
+		mChanges.rebuilt = !mNodes.empty();
+		clear();
 		return topcode_codes;
+	}
 	// WE HAVE CODES
-	KDTree<P2> kdtree;
-	P2 p2;
-	mCvGraphCodeInGraphMap.clear();
+	mTree.clear();
+	std::vector<TopCodes::Code*>::iterator it;
+	it = topcode_codes.begin();
+	while (it != topcode_codes.end()) {
+		TopCodes::Code *code = (*it);
+		mTree.push_back(code->x, code->y);
+		++it;
+	}
+	mTree.balance();
+	int ncodes = (int)topcode_codes.size();
+	mNeighbors.resize(ncodes*NNEIGHBORS);
+	mNeighborCount.resize(ncodes);
+
+	if (!mGraph || !update(topcode_codes))
+		rebuild(topcode_codes, image);
+
+	// remember this frame for the next incremental update.  Codes that
+	// were not rewired keep the position their edges were computed at,
+	// so that slow movement adds up until it counts as a move.
+	mNextNodes.resize(ncodes);
+	for (int c=0; c<ncodes; ++c) {
+		CvGraphCode *mycode = (CvGraphCode*)topcode_codes[c];
+		Node &node = mNextNodes[c];
+		node.x    = mycode->x;
+		node.y    = mycode->y;
+		node.code = mycode->code;
+		node.vtx  = cvGraphVtxIdx(mGraph, mycode->mCvGraphVtx);
+		if (mChanges.rebuilt || mDirty[c]!=UNCHANGED) {
+			node.ax = mycode->x;
+			node.ay = mycode->y;
+		} else {
+			node.ax = mNodes[mPrevOf[c]].ax;
+			node.ay = mNodes[mPrevOf[c]].ay;
+		}
+	}
+	mNodes.swap(mNextNodes);
+	mPrevTree.swap(mTree);
+
+	if (annotate)
+		annotateEdges(annotate);
+	return topcode_codes;
+}
+
+/** Builds the graph from scratch: one vertex per code, the spacing
+	of the codes from a histogram of neighbor distances, and the
+	edges of every code.
+*/
+void DirectedGraphScanner::rebuild(std::vector<Code*> &topcode_codes, const Image *image) {
+	for (size_t n=0; n<mNodes.size(); ++n)
+		mChanges.removed.push_back(mNodes[n].vtx);
+	mChanges.rebuilt = true;
+	releaseGraph();
+
 	CvGraph *G;
 	mMemStorage = cvCreateMemStorage();
 	G = cvCreateGraph(	CV_ORIENTED_GRAPH, sizeof(CvGraph),
 						sizeof(CvGraphVtx), sizeof(CvGraphEdge),
 						mMemStorage);
-	std::vector<TopCodes::Code*>::iterator it;
-	it = topcode_codes.begin();
-	while (it != topcode_codes.end()) {
-		TopCodes::Code *code = (*it);
-		CvGraphCode *mycode = (CvGraphCode*)code;
-		p2.x      = code->x;
-		p2.y      = code->y;
-		p2.mycode = mycode;
-		kdtree.push_back(p2);
+	int ncodes = (int)topcode_codes.size();
+	for (int c=0; c<ncodes; ++c) {
+		CvGraphCode *mycode = (CvGraphCode*)topcode_codes[c];
 		// ADD NODE TO GRAPH FOR EACH TopCode
 		int vv = cvGraphAddVtx(G);
 		CvGraphVtx *v = cvGetGraphVtx(G, vv);
 		mycode->mCvGraphVtx = v;
 		// add to map
 		mCvGraphCodeInGraphMap[vv] = mycode;
-		++it;
+		mChanges.added.push_back(vv);
 	}
-	kdtree.balance();
+	this->mGraph = G;
 
 	// Estimate the average distance between TopCodes on grid
 	// Using HISTOGRAM ANALYSIS. This code on every scale of TopCodes in image
 	float searchRadius;
-	int cnt=0;
-	it = topcode_codes.begin();
 	int histBinSz=10;
 	int histSz = (image->width/histBinSz);
-	unsigned short *hist = new unsigned short[histSz];
-	memset(hist, 0, sizeof(unsigned short)*histSz);
+	mHist.assign(histSz, 0);
 	int histPeakIndex=-1;
 	int histPeakValue=-1;
-	const int NNEIGHBORS=8;
-	while (it != topcode_codes.end()) {
-		TopCodes::Code *code = (*it);
-		p2.x=code->x;
-		p2.y=code->y;
-		p2.code = code->code;
-		std::vector<P2> pnts;
-		kdtree.query(p2, NNEIGHBORS, image->width/2,pnts);
-		for (int i=0; i<pnts.size();++i) {
-			if (fabs(p2.x-pnts[i].x)>=1 && fabs(p2.y-pnts[i].y)>=1) {
-				searchRadius=sqrt( (p2.x-pnts[i].x)*(p2.x-pnts[i].x) +
-								   (p2.y-pnts[i].y)*(p2.y-pnts[i].y)
-								   );
+	mTree.queryAll(NNEIGHBORS, image->width/2, &mNeighbors[0], &mNeighborCount[0]);
+	for (int c=0; c<ncodes; ++c) {
+		TopCodes::Code *code = topcode_codes[c];
+		const FlatKDTree::Neighbor *pnts = &mNeighbors[c*NNEIGHBORS];
+		for (int i=0; i<mNeighborCount[c];++i) {
+			TopCodes::Code *other = topcode_codes[pnts[i].index];
+			if (fabs(code->x-other->x)>=1 && fabs(code->y-other->y)>=1) {
+				searchRadius=pnts[i].dist;
 				int histIndex = (int)searchRadius/histBinSz;
-				hist[histIndex]++;
-				if (hist[histIndex]>histPeakValue) {
-					histPeakValue=hist[histIndex];
+				mHist[histIndex]++;
+				if (mHist[histIndex]>histPeakValue) {
+					histPeakValue=mHist[histIndex];
 					histPeakIndex=histIndex;
 				}
 			}
 		}
-		++it;
 	}
-	delete [] hist;
-	searchRadius = sqrt(2.5)*histPeakIndex*histBinSz;
+	mSearchRadius = sqrt(2.5)*histPeakIndex*histBinSz;
 
 	// INSERT GRAPH EDGES USING KDTREE Queries
-	it = topcode_codes.begin();
-	while (it != topcode_codes.end()) {
-		TopCodes::Code *code = (*it);
-		CvGraphCode *mycode = (CvGraphCode*)code;
-		p2.x=code->x;
-		p2.y=code->y;
-		p2.code = code->code;
-		p2.mycode = mycode;
-		std::vector<P2> pnts;
-		kdtree.query(p2,NNEIGHBORS,searchRadius,pnts);
-		CvScalar lineColor;
-		const float D_AABB = searchRadius/2.0f;
-		for (int i=0; i<pnts.size();++i) {
-			if (pnts[i].x>p2.x && fabs(pnts[i].y-p2.y)<=D_AABB)	{
-				// IDENTIFIED ALMOST-HORIZ LINE
-				if (annotate) {
-					lineColor = CV_RGB(255,0,255);
-					cvLine(annotate, cvPoint(p2.x,p2.y),cvPoint(pnts[i].x,pnts[i].y),lineColor);
-				}
-				// Connect In Graph
-				cvGraphAddEdgeByPtr(G, mycode->mCvGraphVtx, pnts[i].mycode->mCvGraphVtx);
-			}
-			else if (pnts[i].y>p2.y && fabs(pnts[i].x-p2.x)<=D_AABB)	{
-				// IDENTIFIED ALMOST-VERT LINE
-				if (annotate) {
-					lineColor = CV_RGB(0,0,255);
-					cvLine(annotate, cvPoint(p2.x,p2.y),cvPoint(pnts[i].x,pnts[i].y),lineColor);
-				}
-				// Connect In Graph
-				cvGraphAddEdgeByPtr(G, mycode->mCvGraphVtx, pnts[i].mycode->mCvGraphVtx);
+	mTree.queryAll(NNEIGHBORS, mSearchRadius, &mNeighbors[0], &mNeighborCount[0]);
+	for (int c=0; c<ncodes; ++c) {
+		connect(topcode_codes, c, &mNeighbors[c*NNEIGHBORS], mNeighborCount[c]);
+		mChanges.rewired.push_back(mChanges.added[c]);
+	}
+}
+
+/** Updates the graph of the previous scan to the codes of this one.
+	Codes are matched to the previous vertices by id and position;
+	vertices of codes that vanished are removed and codes that appeared
+	get new ones.  Only codes within the search radius of a change have
+	their edges recomputed, since no other neighbor list can differ.
+	Returns false, leaving the graph untouched, if so much changed that
+	a rebuild is cheaper or there is no spacing estimate to reuse.
+*/
+bool DirectedGraphScanner::update(std::vector<Code*> &topcode_codes) {
+	if (mSearchRadius<=0) return false;
+	int ncodes = (int)topcode_codes.size();
+	int nprev = (int)mNodes.size();
+	const float matchRadius = mSearchRadius/2.0f;
+	mPrevOf.assign(ncodes, -1);
+	mMatched.assign(nprev, 0);
+	mDirty.assign(ncodes, UNCHANGED);
+
+	// MATCH CODES TO THE PREVIOUS FRAME
+	FlatKDTree::Neighbor pnts[NNEIGHBORS];
+	int matched=0, moved=0;
+	for (int c=0; c<ncodes; ++c) {
+		TopCodes::Code *code = topcode_codes[c];
+		int n = mPrevTree.query(code->x, code->y, NNEIGHBORS, matchRadius, pnts);
+		for (int i=0; i<n; ++i) {
+			int p = pnts[i].index;
+			if (mMatched[p] || mNodes[p].code!=code->code) continue;
+			mMatched[p] = 1;
+			mPrevOf[c] = p;
+			matched++;
+			// moved if it drifted a unit from where its edges were made
+			float dx = code->x-mNodes[p].ax;
+			float dy = code->y-mNodes[p].ay;
+			if (dx*dx+dy*dy>code->unit*code->unit) {
+				mDirty[c] = MOVED;
+				moved++;
 			}
+			break;
 		}
-		++it;
 	}
+	int changed = (ncodes-matched) + (nprev-matched) + moved;
+	if (changed*REBUILD_FRACTION>ncodes) return false;
 
-	this->mGraph = G;
-	return topcode_codes;
+	CvGraph *G = mGraph;
+	mNearby.resize(ncodes);
+
+	// REMOVE VANISHED CODES
+	for (int p=0; p<nprev; ++p) {
+		if (mMatched[p]) continue;
+		cvGraphRemoveVtx(G, mNodes[p].vtx);
+		mCvGraphCodeInGraphMap.erase(mNodes[p].vtx);
+		mChanges.removed.push_back(mNodes[p].vtx);
+		markNearby(mNodes[p].x, mNodes[p].y);
+	}
+
+	// ADD NEW CODES, AND REFRESH THE CODES OF MATCHED VERTICES
+	for (int c=0; c<ncodes; ++c) {
+		CvGraphCode *mycode = (CvGraphCode*)topcode_codes[c];
+		int vv;
+		if (mPrevOf[c]<0) {
+			vv = cvGraphAddVtx(G);
+			mChanges.added.push_back(vv);
+			mDirty[c] = ADDED;
+		} else {
+			vv = mNodes[mPrevOf[c]].vtx;
+			if (mDirty[c]==MOVED) mChanges.moved.push_back(vv);
+		}
+		mycode->mCvGraphVtx = cvGetGraphVtx(G, vv);
+		mCvGraphCodeInGraphMap[vv] = mycode;
+	}
+	for (int c=0; c<ncodes; ++c) {
+		if (mDirty[c]==MOVED) {
+			const Node &old = mNodes[mPrevOf[c]];
+			markNearby(old.ax, old.ay);
+		}
+		if (mDirty[c]==ADDED || mDirty[c]==MOVED)
+			markNearby(topcode_codes[c]->x, topcode_codes[c]->y);
+	}
+
+	// RECOMPUTE THE EDGES OF CODES NEAR A CHANGE
+	for (int c=0; c<ncodes; ++c) {
+		if (mDirty[c]==UNCHANGED) continue;
+		CvGraphCode *mycode = (CvGraphCode*)topcode_codes[c];
+		disconnect(mycode->mCvGraphVtx);
+		int n = mTree.query(mycode->x, mycode->y, NNEIGHBORS, mSearchRadius, pnts);
+		connect(topcode_codes, c, pnts, n);
+		mChanges.rewired.push_back(cvGraphVtxIdx(G, mycode->mCvGraphVtx));
+	}
+	return true;
+}
+
+/** Marks the codes whose neighbor lists can change because of a code
+	appearing, vanishing or moving at (x, y).
+*/
+void DirectedGraphScanner::markNearby(float x, float y) {
+	int n = mTree.queryRadius(x, y, mSearchRadius, &mNearby[0], (int)mNearby.size());
+	for (int i=0; i<n; ++i) {
+		if (mDirty[mNearby[i]]==UNCHANGED) mDirty[mNearby[i]] = NEAR_CHANGE;
+	}
+}
+
+/** Adds the edges from code c to those of its neighbors that lie
+	almost horizontally to its right or almost vertically below it.
+*/
+void DirectedGraphScanner::connect(	std::vector<Code*> &topcode_codes, int c,
+									const FlatKDTree::Neighbor *pnts, int n) {
+	const float D_AABB = mSearchRadius/2.0f;
+	CvGraphCode *mycode = (CvGraphCode*)topcode_codes[c];
+	for (int i=0; i<n;++i) {
+		CvGraphCode *other = (CvGraphCode*)topcode_codes[pnts[i].index];
+		if ((other->x>mycode->x && fabs(other->y-mycode->y)<=D_AABB) ||	// ALMOST-HORIZ LINE
+			(other->y>mycode->y && fabs(other->x-mycode->x)<=D_AABB))	{	// ALMOST-VERT LINE
+			// Connect In Graph
+			cvGraphAddEdgeByPtr(mGraph, mycode->mCvGraphVtx, other->mCvGraphVtx);
+		}
+	}
+}
+
+/** Removes the outgoing edges of a vertex.  cvGraphRemoveEdgeByPtr
+	ignores the direction of edges, so if it took the edge coming back
+	from the target instead, that edge is put back.
+*/
+void DirectedGraphScanner::disconnect(CvGraphVtx *v) {
+	mTargets.clear();
+	for (CvGraphEdge *e = v->first; e; e = CV_NEXT_GRAPH_EDGE(e, v)) {
+		if (e->vtx[0]==v) mTargets.push_back(e->vtx[1]);
+	}
+	for (size_t i=0; i<mTargets.size(); ++i) {
+		CvGraphVtx *w = mTargets[i];
+		cvGraphRemoveEdgeByPtr(mGraph, v, w);
+		if (cvFindGraphEdgeByPtr(mGraph, v, w)) {
+			cvGraphRemoveEdgeByPtr(mGraph, v, w);
+			cvGraphAddEdgeByPtr(mGraph, w, v);
+		}
+	}
+}
+
+/** Draws every edge of the graph, horizontal ones in magenta and
+	vertical ones in blue
+*/
+void DirectedGraphScanner::annotateEdges(Image *annotate) {
+	const float D_AABB = mSearchRadius/2.0f;
+	CvScalar lineColor;
+	std::map<int, CvGraphCode*>::iterator it;
+	for (it = mCvGraphCodeInGraphMap.begin(); it != mCvGraphCodeInGraphMap.end(); ++it) {
+		CvGraphCode *mycode = it->second;
+		CvGraphVtx *v = mycode->mCvGraphVtx;
+		for (CvGraphEdge *e = v->first; e; e = CV_NEXT_GRAPH_EDGE(e, v)) {
+			if (e->vtx[0]!=v) continue;
+			CvGraphCode *other = mCvGraphCodeInGraphMap[cvGraphVtxIdx(mGraph, e->vtx[1])];
+			if (other->x>mycode->x && fabs(other->y-mycode->y)<=D_AABB)
+				lineColor = CV_RGB(255,0,255);
+			else
+				lineColor = CV_RGB(0,0,255);
+			cvLine(annotate, cvPoint(mycode->x,mycode->y),cvPoint(other->x,other->y),lineColor);
+		}
+	}
 }
 
 	CvGraphCode::CvGraphCode() : mCvGraphVtx(NULL) {}
@@ -144,7 +317,7 @@ DirectedGraphScanner::scan(	const Image  *image,
 		return new CvGraphCode();
 	}
 
-	void DirectedGraphScanner::clear() {
+	void DirectedGraphScanner::releaseGraph() {
 		if (mGraph) {
 			cvClearGraph(mGraph);
 			mGraph=NULL;
@@ -153,4 +326,10 @@ DirectedGraphScanner::scan(	const Image  *image,
 		cvReleaseMemStorage(&mMemStorage);
 		mMemStorage=NULL;
 	}
+
+	void DirectedGraphScanner::clear() {
+		releaseGraph();
+		mNodes.clear();
+		mPrevTree.clear();
+	}
 }
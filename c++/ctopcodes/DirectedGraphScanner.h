@@ -2,6 +2,7 @@
 #define DIRECTED_GRAPH_SCANNER_H
 
 #include "topcode.h"
+#include "kdtree.hpp"
 #include <vector>
 #include <map>
 
@@ -23,16 +24,63 @@ namespace TopCodes {
 		virtual Code* create();
 	};
 
+	/** Vertices of the graph that changed in the last scan.  Indices of
+		removed vertices may be reused by vertices added in the same scan.
+	*/
+	struct GraphChanges {
+		std::vector<int> added;   // vertices of codes that appeared
+		std::vector<int> removed; // vertices of codes that vanished
+		std::vector<int> moved;   // vertices of codes that moved
+		std::vector<int> rewired; // vertices whose outgoing edges were recomputed
+		bool rebuilt;             // the whole graph was built again
+	};
+
 	class DirectedGraphScanner : public Scanner {
 	public:
 		DirectedGraphScanner();
 		virtual ~DirectedGraphScanner();
 		virtual std::vector<Code*> scan(const Image *image, ScanListener *l = NULL, Image *annotate = NULL);
 		virtual void clear(); // release allocated resources after usage.
+		// Keep the graph from one scan to the next and only update it
+		// around codes that appeared, vanished or moved
+		void setIncremental(bool incremental) { mIncremental = incremental; }
+		const GraphChanges &getChanges() const { return mChanges; }
 		CvGraph *mGraph;
 		std::map<int, CvGraphCode*> mCvGraphCodeInGraphMap;
 	private:
 		CvMemStorage *mMemStorage;
+		bool mIncremental;
+		float mSearchRadius;
+		GraphChanges mChanges;
+		// A code of the previous scan and its vertex, and where the code
+		// was when its edges were last computed
+		struct Node {
+			float x, y;
+			float ax, ay;
+			int code;
+			int vtx;
+		};
+		std::vector<Node> mNodes;
+		std::vector<Node> mNextNodes;
+		FlatKDTree mPrevTree;
+		std::vector<int> mPrevOf;         // matching node of each code, or -1
+		std::vector<unsigned char> mMatched;
+		std::vector<unsigned char> mDirty;
+		std::vector<int> mNearby;
+		std::vector<CvGraphVtx*> mTargets;
+		void rebuild(std::vector<Code*> &codes, const Image *image);
+		bool update(std::vector<Code*> &codes);
+		void markNearby(float x, float y);
+		void connect(std::vector<Code*> &codes, int c, const FlatKDTree::Neighbor *pnts, int n);
+		void disconnect(CvGraphVtx *v);
+		void annotateEdges(Image *annotate);
+		void releaseGraph();
+		// Neighbor search state, kept between scans so that it is only
+		// reallocated when the number of codes grows
+		FlatKDTree mTree;
+		std::vector<FlatKDTree::Neighbor> mNeighbors; // NNEIGHBORS per code
+		std::vector<int> mNeighborCount;
+		std::vector<unsigned short> mHist;
 	};
 }
 
@@ -0,0 +1,229 @@
+#include "Lattice.h"
+#include <math.h>
+#include <algorithm>
+
+namespace TopCodes {
+
+static const float QUARTER = 1.5707963f;
+// How far (in pitches) a neighbor may be from where it was predicted
+static const float POSITION_TOLERANCE = 0.4f;
+// How far (in radians) the axes of two linked codes may differ
+static const float ANGLE_TOLERANCE = 0.5f;
+static const long long EMPTY_SLOT = 0x7fffffffffffffffLL;
+
+//----------------------------------------
+// Wraps an angle into [-QUARTER/2, QUARTER/2)
+//----------------------------------------
+static inline float quarterAngle(float a) {
+	a = fmodf(a + QUARTER / 2, QUARTER);
+	if (a < 0) a += QUARTER;
+	return a - QUARTER / 2;
+}
+
+static inline long long cellKey(int cx, int cy) {
+	return ((long long)cx << 32) ^ (unsigned int)cy;
+}
+
+static inline unsigned int cellHash(int cx, int cy) {
+	return (unsigned int)cx * 73856093u ^ (unsigned int)cy * 19349663u;
+}
+
+Lattice::Lattice()
+	: mPitch(0), mEstimatedPitch(0), mCodes(NULL), mCell(0) {
+}
+
+void Lattice::build(const std::vector<Code*> &codes) {
+	int n = (int)codes.size();
+	mCodes = &codes;
+	// The board axis is the circular mean of the orientations taken four
+	// times over, so a quarter turn apart counts as the same.  Each code's
+	// angle is then taken within an eighth turn of it; wrapping each on its
+	// own would put codes near 45 degrees on either side of the wrap.
+	float sx = 0, sy = 0;
+	for (int i=0; i<n; i++) {
+		sx += cosf(4 * codes[i]->orientation);
+		sy += sinf(4 * codes[i]->orientation);
+	}
+	float axis = (n > 0) ? atan2f(sy, sx) / 4 : 0;
+	mAngle.resize(n);
+	for (int i=0; i<n; i++) {
+		mAngle[i] = axis + quarterAngle(codes[i]->orientation - axis);
+	}
+	mRight.assign(n, -1); mLeft.assign(n, -1);
+	mBelow.assign(n, -1); mAbove.assign(n, -1);
+
+	if (mPitch <= 0) estimatePitch();
+	float pitch = getPitch();
+	if (n > 1 && pitch > 0) {
+		// cells about one pitch wide, so any prediction is covered by
+		// the 3x3 cells around it
+		mScratch.resize(n);
+		for (int i=0; i<n; i++) mScratch[i] = codes[i]->unit;
+		std::nth_element(mScratch.begin(), mScratch.begin() + n / 2, mScratch.end());
+		hashCodes(pitch * mScratch[n / 2]);
+		link(mRight, mLeft, 0);
+		link(mBelow, mAbove, 1);
+	}
+	chain(mRight, mLeft, 0, mRowCodes, mRowStart);
+	chain(mBelow, mAbove, 1, mColumnCodes, mColumnStart);
+}
+
+/** The pitch is the median distance from a code to its nearest
+	neighbor in units.  The neighbors are found in the spatial hash,
+	starting with cells a bit larger than a printed code and widening
+	them until most codes have a neighbor in reach.
+*/
+void Lattice::estimatePitch() {
+	const std::vector<Code*> &codes = *mCodes;
+	int n = (int)codes.size();
+	mEstimatedPitch = 0;
+	if (n < 2) return;
+	mScratch.resize(n);
+	for (int i=0; i<n; i++) mScratch[i] = codes[i]->unit;
+	std::nth_element(mScratch.begin(), mScratch.begin() + n / 2, mScratch.end());
+	float cell = 12 * mScratch[n / 2];
+
+	for (int tries=0; tries<4; tries++, cell *= 2) {
+		hashCodes(cell);
+		int found = 0;
+		for (int i=0; i<n; i++) {
+			float dist;
+			if (findNear(codes[i]->x, codes[i]->y, cell, i, false, dist) >= 0) {
+				mScratch[found++] = dist / codes[i]->unit;
+			}
+		}
+		if (found * 2 >= n) {
+			std::nth_element(mScratch.begin(), mScratch.begin() + found / 2, mScratch.begin() + found);
+			mEstimatedPitch = mScratch[found / 2];
+			return;
+		}
+	}
+}
+
+//----------------------------------------
+// Chains each code into the hash slot of
+// its cell. The table is at least twice
+// the number of codes
+//----------------------------------------
+void Lattice::hashCodes(float cell) {
+	const std::vector<Code*> &codes = *mCodes;
+	int n = (int)codes.size();
+	int size = 1;
+	while (size < 2 * n) size <<= 1;
+	mCell = cell;
+	mSlotKey.assign(size, EMPTY_SLOT);
+	mSlotHead.resize(size);
+	mNextInCell.resize(n);
+	for (int i=0; i<n; i++) {
+		int cx = (int)floorf(codes[i]->x / cell);
+		int cy = (int)floorf(codes[i]->y / cell);
+		long long key = cellKey(cx, cy);
+		unsigned int s = cellHash(cx, cy) & (size - 1);
+		while (mSlotKey[s] != EMPTY_SLOT && mSlotKey[s] != key) s = (s + 1) & (size - 1);
+		if (mSlotKey[s] == EMPTY_SLOT) {
+			mSlotKey[s] = key;
+			mSlotHead[s] = -1;
+		}
+		mNextInCell[i] = mSlotHead[s];
+		mSlotHead[s] = i;
+	}
+}
+
+/** Nearest code other than self within tolerance (at most one cell) of
+	(x, y), or -1.  With sameAxes the code's axes must also line up with
+	those of self.
+*/
+int Lattice::findNear(float x, float y, float tolerance, int self, bool sameAxes, float &dist) const {
+	const std::vector<Code*> &codes = *mCodes;
+	int size = (int)mSlotKey.size();
+	int cx = (int)floorf(x / mCell);
+	int cy = (int)floorf(y / mCell);
+	float best = tolerance * tolerance;
+	int nearest = -1;
+	for (int dy=-1; dy<=1; dy++) {
+		for (int dx=-1; dx<=1; dx++) {
+			long long key = cellKey(cx + dx, cy + dy);
+			unsigned int s = cellHash(cx + dx, cy + dy) & (size - 1);
+			while (mSlotKey[s] != EMPTY_SLOT && mSlotKey[s] != key) s = (s + 1) & (size - 1);
+			if (mSlotKey[s] == EMPTY_SLOT) continue;
+			for (int j=mSlotHead[s]; j>=0; j=mNextInCell[j]) {
+				if (j == self) continue;
+				float ex = codes[j]->x - x;
+				float ey = codes[j]->y - y;
+				float d = ex * ex + ey * ey;
+				if (d >= best) continue;
+				if (sameAxes && fabsf(quarterAngle(mAngle[j] - mAngle[self])) > ANGLE_TOLERANCE) continue;
+				best = d;
+				nearest = j;
+			}
+		}
+	}
+	if (nearest >= 0) dist = sqrtf(best);
+	return nearest;
+}
+
+/** Links each code to the code found one pitch away along its x axis
+	(axis 0) or y axis (axis 1).  A code claimed by two others keeps the
+	one that predicted its position best.
+*/
+void Lattice::link(std::vector<int> &next, std::vector<int> &prev, int axis) {
+	const std::vector<Code*> &codes = *mCodes;
+	int n = (int)codes.size();
+	float pitch = getPitch();
+	mLinkError.assign(n, 0);
+	for (int i=0; i<n; i++) {
+		Code *code = codes[i];
+		float step = pitch * code->unit;
+		float ux = cosf(mAngle[i]) * step;
+		float uy = sinf(mAngle[i]) * step;
+		float px = (axis == 0) ? code->x + ux : code->x - uy;
+		float py = (axis == 0) ? code->y + uy : code->y + ux;
+		float dist;
+		int j = findNear(px, py, std::min(POSITION_TOLERANCE * step, mCell), i, true, dist);
+		if (j < 0) continue;
+		if (prev[j] >= 0) {
+			if (mLinkError[j] <= dist) continue;
+			next[prev[j]] = -1;
+		}
+		next[i] = j;
+		prev[j] = i;
+		mLinkError[j] = dist;
+	}
+}
+
+/** Lays the chains of links out one after another, starting each from
+	a code with no predecessor.  Chains are ordered by the y (rows) or
+	x (columns) position of their first code.
+*/
+void Lattice::chain(const std::vector<int> &next, const std::vector<int> &prev, int axis,
+					std::vector<Code*> &sequence, std::vector<int> &start) {
+	const std::vector<Code*> &codes = *mCodes;
+	int n = (int)codes.size();
+	mHeads.clear();
+	for (int i=0; i<n; i++) {
+		if (prev[i] < 0) mHeads.push_back(std::make_pair(axis == 0 ? codes[i]->y : codes[i]->x, i));
+	}
+	std::sort(mHeads.begin(), mHeads.end());
+	sequence.resize(n);
+	start.clear();
+	mVisited.assign(n, 0);
+	int k = 0;
+	for (size_t h=0; h<mHeads.size(); h++) {
+		start.push_back(k);
+		for (int i=mHeads[h].second; i>=0 && !mVisited[i]; i=next[i]) {
+			mVisited[i] = 1;
+			sequence[k++] = codes[i];
+		}
+	}
+	// links that close on themselves have no first code; cut them anywhere
+	for (int i=0; i<n; i++) {
+		if (mVisited[i]) continue;
+		start.push_back(k);
+		for (int j=i; j>=0 && !mVisited[j]; j=next[j]) {
+			mVisited[j] = 1;
+			sequence[k++] = codes[j];
+		}
+	}
+	start.push_back(k);
+}
+}
@@ -0,0 +1,69 @@
+#ifndef LATTICE_H
+#define LATTICE_H
+
+#include "topcode.h"
+#include <vector>
+#include <utility>
+
+namespace TopCodes {
+	/** Rows and columns of codes laid out on a board.  Each code's own
+		orientation (taken modulo a quarter turn) and unit predict where
+		its right and lower neighbors are, and the code nearest each
+		prediction is looked up in a spatial hash.  Links are kept one
+		to one, so rows and columns are chains that are read off by
+		walking them from their first code.  Unlike the axis-aligned
+		tests of DirectedGraphScanner this follows a board at any
+		rotation, and it is linear in the number of codes.
+		Rows run along the board axis closest to the image x axis.
+	*/
+	class Lattice {
+	public:
+		Lattice();
+		/** Distance between neighboring tile centers in units (ring
+			widths), or 0 to estimate it from the codes on every build */
+		void            setPitch(float units) { mPitch = units; }
+		float           getPitch() const { return mPitch > 0 ? mPitch : mEstimatedPitch; }
+		void            build(const std::vector<Code*> &codes);
+
+		/** Rows from top to bottom, each from left to right, and columns
+			from left to right, each from top to bottom.  A code with no
+			neighbor along an axis is a sequence of its own */
+		int             getRowCount() const { return (int)mRowStart.size() - 1; }
+		int             getRowLength(int r) const { return mRowStart[r + 1] - mRowStart[r]; }
+		Code * const   *getRow(int r) const { return &mRowCodes[mRowStart[r]]; }
+		int             getColumnCount() const { return (int)mColumnStart.size() - 1; }
+		int             getColumnLength(int c) const { return mColumnStart[c + 1] - mColumnStart[c]; }
+		Code * const   *getColumn(int c) const { return &mColumnCodes[mColumnStart[c]]; }
+
+		/** Index (in the vector given to build) of the next code to the
+			right or below code i, or -1 */
+		int             getRight(int i) const { return mRight[i]; }
+		int             getBelow(int i) const { return mBelow[i]; }
+	protected:
+		void            estimatePitch();
+		void            hashCodes(float cell);
+		int             findNear(float x, float y, float tolerance, int self, bool sameAxes, float &dist) const;
+		void            link(std::vector<int> &next, std::vector<int> &prev, int axis);
+		void            chain(const std::vector<int> &next, const std::vector<int> &prev, int axis,
+							  std::vector<Code*> &sequence, std::vector<int> &start);
+
+		float           mPitch;
+		float           mEstimatedPitch;
+		const std::vector<Code*> *mCodes;
+		std::vector<float> mAngle;    /** Orientation of each code modulo a quarter turn, nearest the board axis */
+		// spatial hash: open addressing on grid cells, codes chained per cell
+		float           mCell;
+		std::vector<long long> mSlotKey;
+		std::vector<int> mSlotHead;
+		std::vector<int> mNextInCell;
+		std::vector<int> mRight, mLeft, mBelow, mAbove;
+		std::vector<float> mLinkError; /** Distance of each code from where its link predicted it */
+		std::vector<float> mScratch;
+		std::vector<int> mVisited;
+		std::vector<std::pair<float, int> > mHeads;
+		std::vector<Code*> mRowCodes, mColumnCodes;
+		std::vector<int> mRowStart, mColumnStart;
+	};
+}
+
+#endif
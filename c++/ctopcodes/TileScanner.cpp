@@ -0,0 +1,158 @@
+#include "TileScanner.h"
+#include "MyTime.h"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TOPCODES_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace TopCodes {
+
+TileScanner::TileScanner(ThresholdMode mode)
+	: Scanner(mode), mTilesX(0), mTilesY(0) {
+}
+TileScanner::~TileScanner() {
+}
+
+std::vector<Code*>
+TileScanner::findCodes(ScanListener *l) {
+	int w = image->width;
+	int h = image->height;
+	mTilesX = (w + TILE_W - 1) / TILE_W;
+	mTilesY = (h + TILE_H - 1) / TILE_H;
+	mTileCodes.resize(mTilesX * mTilesY);
+	mTileOffsets.resize(mTilesX * mTilesY + 1);
+
+	std::vector<Code*> codes;
+	TIME_COMMAND("tiles", scanTiles();)
+	TIME_COMMAND("build-list", packTiles(codes);)
+
+	if (l) {
+		// hand the codes to the listener, dropping any it does not take
+		l->onBegin();
+		size_t i = 0;
+		while (i < codes.size()) {
+			if (l->onNewCode(codes[i++]) != 0) break;
+		}
+		for (; i < codes.size(); i++) {
+			delete codes[i];
+		}
+		codes.clear();
+		l->onEnd();
+	}
+	return codes;
+}
+
+//----------------------------------------
+// Searches the tiles on as many threads as
+// there are, each with its own scratch code
+//----------------------------------------
+void TileScanner::scanTiles() {
+	int tiles = mTilesX * mTilesY;
+	#pragma omp parallel
+	{
+		Code *spot;
+		#pragma omp critical
+		{
+			spot = (mCodeFactory) ? mCodeFactory->create() : new Code();
+		}
+		#pragma omp for schedule(dynamic)
+		for (int t=0; t<tiles; t++) {
+			scanTile(t, spot);
+		}
+		delete spot;
+	}
+}
+
+//----------------------------------------
+// Packs the per-tile lists into codes: the
+// offsets are a prefix sum of the tile
+// counts, then each tile copies its codes
+// into its own slot
+//----------------------------------------
+void TileScanner::packTiles(std::vector<Code*> &codes) {
+	int tiles = mTilesX * mTilesY;
+	mTileOffsets[0] = 0;
+	for (int t=0; t<tiles; t++) {
+		mTileOffsets[t + 1] = mTileOffsets[t] + mTileCodes[t].size();
+	}
+	codes.resize(mTileOffsets[tiles]);
+	#pragma omp parallel for schedule(static)
+	for (int t=0; t<tiles; t++) {
+		for (size_t i=0; i<mTileCodes[t].size(); i++) {
+			codes[mTileOffsets[t] + i] = mTileCodes[t][i];
+		}
+		mTileCodes[t].clear();
+	}
+}
+
+//----------------------------------------
+// Decodes every candidate pixel of one tile
+// (a pixel marked as a bulls-eye center with
+// its four neighbours marked too), using
+// spot as scratch space. The border two
+// pixels wide is skipped as in the kernel,
+// and so is whatever the mask leaves out.
+//----------------------------------------
+void TileScanner::scanTile(int tile, Code *spot) {
+	const unsigned int M = 0x2000000;
+	int w = image->width;
+	int h = image->height;
+	int x0 = (tile % mTilesX) * TILE_W;
+	int y0 = (tile / mTilesX) * TILE_H;
+	int x1 = (x0 + TILE_W < w - 2) ? x0 + TILE_W : w - 2;
+	int y1 = (y0 + TILE_H < h - 2) ? y0 + TILE_H : h - 2;
+	if (x0 < 2) x0 = 2;
+	if (y0 < 2) y0 = 2;
+	if (x0 < mSpanLeft) x0 = mSpanLeft;
+	if (x1 > mSpanRight) x1 = mSpanRight;
+	if (y0 < mSpanTop) y0 = mSpanTop;
+	if (y1 > mSpanBottom) y1 = mSpanBottom;
+	std::vector<Code*> &found = mTileCodes[tile];
+
+	for (int j=y0; j<y1; j++) {
+		if (mSpanRow[j] == mSpanRow[j + 1]) continue;
+		const unsigned int *row = gData + j * w;
+		int i = x0;
+		int bits;
+#ifdef TOPCODES_SSE2
+		//----------------------------------------
+		// Test four pixels at a time, and only
+		// look at the ones that pass
+		//----------------------------------------
+		const __m128i mask = _mm_set1_epi32(M);
+		for (; i + 4 <= x1; i += 4) {
+			__m128i m = _mm_loadu_si128((const __m128i *)(row + i));
+			m = _mm_and_si128(m, _mm_loadu_si128((const __m128i *)(row + i - 1)));
+			m = _mm_and_si128(m, _mm_loadu_si128((const __m128i *)(row + i + 1)));
+			m = _mm_and_si128(m, _mm_loadu_si128((const __m128i *)(row + i - w)));
+			m = _mm_and_si128(m, _mm_loadu_si128((const __m128i *)(row + i + w)));
+			m = _mm_cmpeq_epi32(_mm_and_si128(m, mask), mask);
+			bits = _mm_movemask_ps(_mm_castsi128_ps(m));
+			for (int b=0; bits; b++, bits >>= 1) {
+				if (!(bits & 1)) continue;
+				spot->decode(*this, i + b, j);
+				if (spot->isValid()) {
+					spot->x = (float)(i + b);
+					spot->y = (float)j;
+					found.push_back(spot->clone());
+				}
+			}
+		}
+#endif
+		for (; i < x1; i++) {
+			if (!((row[i]   & M) &&
+				  (row[i-1] & M) &&
+				  (row[i+1] & M) &&
+				  (row[i-w] & M) &&
+				  (row[i+w] & M))) continue;
+			spot->decode(*this, i, j);
+			if (spot->isValid()) {
+				spot->x = (float)i;
+				spot->y = (float)j;
+				found.push_back(spot->clone());
+			}
+		}
+	}
+}
+
+}
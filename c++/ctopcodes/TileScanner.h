@@ -0,0 +1,32 @@
+#ifndef TILE_SCANNER_H
+#define TILE_SCANNER_H
+
+#include "topcode.h"
+#include <vector>
+
+namespace TopCodes {
+	/** CPU counterpart of GPUScanner. The image is cut into tiles of
+		TILE_W x TILE_H pixels (the pixels one CUDA thread block covers)
+		that are searched on separate threads. Every pixel that passes
+		the candidate test is decoded on its own, as in the kernel, and
+		the codes found in each tile are packed into one list in tile
+		order. Like GPUScanner there is one code per candidate pixel,
+		so a symbol is usually reported more than once.
+	*/
+	class TileScanner : public Scanner {
+	public:
+		enum TILE { TILE_W=256, TILE_H=16 };
+		TileScanner(ThresholdMode mode = WELLNER);
+		virtual ~TileScanner();
+	protected:
+		virtual std::vector<Code*> findCodes(ScanListener *l=NULL);
+		void            scanTiles();
+		void            scanTile(int tile, Code *spot);
+		void            packTiles(std::vector<Code*> &codes);
+		int             mTilesX, mTilesY;
+		std::vector< std::vector<Code*> > mTileCodes; /** Codes found in each tile */
+		std::vector<size_t> mTileOffsets; /** Start of each tile in the packed list */
+	};
+}
+
+#endif
@@ -163,4 +163,191 @@ void KDTree<Point>::query(
   }
 }
 
+//---------------------------------------------------------------------------------
+// FlatKDTree class: the same tree as KDTree kept in flat arrays of coordinates
+//    and point indices, so that neither building nor querying allocates once
+//    the arrays have grown to the number of points.
+//    Points are push_back'ed in order and identified by that index; balance()
+//    builds the tree. query() writes at most count neighbors closer than
+//    max_radius into a caller-provided buffer, nearest first, and returns how
+//    many it wrote. queryAll() does the same for every point in the tree.
+//---------------------------------------------------------------------------------
+class FlatKDTree {
+	public:
+		struct Neighbor {
+			int   index;  // index of the point in push_back order
+			float dist;
+		};
+	private:
+		std::vector<float> xs, ys;   // coordinates in push_back order
+		std::vector<float> tx, ty;   // coordinates in tree order
+		std::vector<int>   order;    // push_back index of each tree node
+		void buildSubKDTree(int start, int end, int axis);
+		struct axis_less {
+			const float *coord;
+			axis_less(const float *c) : coord(c) {}
+			bool operator()(int i, int j) const { return coord[i]<coord[j]; }
+		};
+		struct dist_less {
+			bool operator()(const Neighbor &a, const Neighbor &b) const {
+				return a.dist<b.dist;
+			}
+		};
+		struct Query {
+			float x, y;
+			int count;
+			float max_dist2;
+			Neighbor *heap;
+			int found;
+		};
+		void findSubNearest(Query &q, int start, int end, int axis) const;
+		void findSubRadius(float x, float y, float radius2, int *indices,
+				   int capacity, int &found, int start, int end, int axis) const;
+	public:
+		void clear() { xs.clear(); ys.clear(); }
+		void swap(FlatKDTree &other) {
+			xs.swap(other.xs); ys.swap(other.ys);
+			tx.swap(other.tx); ty.swap(other.ty);
+			order.swap(other.order);
+		}
+		void push_back(float x, float y) { xs.push_back(x); ys.push_back(y); }
+		int size() const { return (int)xs.size(); }
+		void balance();
+
+		int query(
+			float x, float y,         // query point
+			int count,                // capacity of the neighbors buffer
+			float max_radius,         // maximum radius constrain
+			Neighbor *neighbors       // buffer of returned neighbors
+		) const;
+
+		// neighbors holds count entries per point, found one count per point
+		void queryAll(int count, float max_radius, Neighbor *neighbors, int *found) const;
+
+		// indices of all points closer than radius, in no particular order.
+		// Returns how many there are, which can be more than the capacity
+		// of the buffer; only the first capacity of them are written.
+		int queryRadius(float x, float y, float radius, int *indices, int capacity) const;
+};
+
+inline void FlatKDTree::buildSubKDTree(int start, int end, int axis) {
+  // only the median has to be in place for the search below
+  int midpoint = ((end-start)>>1) + start;
+  std::nth_element(order.begin()+start, order.begin()+midpoint, order.begin()+end+1,
+		   axis_less(axis==0 ? &xs[0] : &ys[0]));
+
+  if (start<midpoint-1)
+    buildSubKDTree(start,midpoint-1,!axis);
+  if (end>midpoint+1)
+    buildSubKDTree(midpoint+1, end,!axis);
+}
+
+inline void FlatKDTree::balance() {
+  int n = size();
+  order.resize(n);
+  tx.resize(n);
+  ty.resize(n);
+  if (n==0) return;
+  for (int i=0; i<n; i++) order[i] = i;
+  buildSubKDTree(0,n-1,0);
+  for (int i=0; i<n; i++) {
+    tx[i] = xs[order[i]];
+    ty[i] = ys[order[i]];
+  }
+}
+
+inline void FlatKDTree::findSubNearest(Query &q, int start, int end, int axis) const {
+
+  int midpoint = ((end-start)>>1) + start;
+  float d = (axis==0) ? q.x-tx[midpoint] : q.y-ty[midpoint];
+
+  // nearer side first, so the heap fills with close points and the far
+  // side is more likely to be pruned
+  int nearStart = start, nearEnd = midpoint-1;
+  int farStart = midpoint+1, farEnd = end;
+  if (d>0) {
+    nearStart = midpoint+1; nearEnd = end;
+    farStart = start; farEnd = midpoint-1;
+  }
+  if (nearStart<=nearEnd)
+    findSubNearest(q, nearStart, nearEnd, !axis);
+
+  float dx = q.x-tx[midpoint];
+  float dy = q.y-ty[midpoint];
+  float dist2 = dx*dx + dy*dy;
+  if (dist2<q.max_dist2) {
+    Neighbor n;
+    n.index = order[midpoint];
+    n.dist = dist2;
+    if (q.found<q.count) {
+      q.heap[q.found++] = n;
+      std::push_heap(q.heap, q.heap+q.found, dist_less());
+    } else if (dist2<q.heap[0].dist) {
+      std::pop_heap(q.heap, q.heap+q.found, dist_less());
+      q.heap[q.found-1] = n;
+      std::push_heap(q.heap, q.heap+q.found, dist_less());
+    }
+  }
+
+  float worst = (q.found<q.count) ? q.max_dist2 : q.heap[0].dist;
+  if (farStart<=farEnd && d*d<=worst)
+    findSubNearest(q, farStart, farEnd, !axis);
+}
+
+inline int FlatKDTree::query(
+			      float x, float y,
+			      int count,
+			      float max_radius,
+			      Neighbor *neighbors
+			      ) const
+{
+  if (size()==0 || count<=0) return 0;
+  Query q;
+  q.x = x;
+  q.y = y;
+  q.count = count;
+  q.max_dist2 = max_radius*max_radius;
+  q.heap = neighbors;
+  q.found = 0;
+  findSubNearest(q, 0, size()-1, 0);
+  std::sort_heap(neighbors, neighbors+q.found, dist_less());
+  for (int i=0; i<q.found; i++) {
+    neighbors[i].dist = sqrt(neighbors[i].dist);
+  }
+  return q.found;
+}
+
+inline void FlatKDTree::queryAll(int count, float max_radius, Neighbor *neighbors, int *found) const {
+  int n = size();
+  #pragma omp parallel for schedule(static)
+  for (int i=0; i<n; i++) {
+    found[i] = query(xs[i], ys[i], count, max_radius, neighbors + i*count);
+  }
+}
+
+inline void FlatKDTree::findSubRadius(float x, float y, float radius2, int *indices,
+				      int capacity, int &found, int start, int end, int axis) const {
+
+  int midpoint = ((end-start)>>1) + start;
+  float d = (axis==0) ? x-tx[midpoint] : y-ty[midpoint];
+  float dx = x-tx[midpoint];
+  float dy = y-ty[midpoint];
+  if (dx*dx + dy*dy<radius2) {
+    if (found<capacity) indices[found] = order[midpoint];
+    found++;
+  }
+  if (start<=midpoint-1 && (d<0 || d*d<radius2))
+    findSubRadius(x, y, radius2, indices, capacity, found, start, midpoint-1, !axis);
+  if (end>=midpoint+1 && (d>0 || d*d<radius2))
+    findSubRadius(x, y, radius2, indices, capacity, found, midpoint+1, end, !axis);
+}
+
+inline int FlatKDTree::queryRadius(float x, float y, float radius, int *indices, int capacity) const {
+  int found = 0;
+  if (size()>0) {
+    findSubRadius(x, y, radius*radius, indices, capacity, found, 0, size()-1, 0);
+  }
+  return found;
+}
+
 #endif
@@ -1,40 +1,108 @@
 #include "topcode.h"
 #include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
 #include "MyTime.h"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TOPCODES_SSE2
+#include <emmintrin.h>
+#endif
 
 #define _iround(v)  (int)((v < 0.0) ? v - 0.5 : v + 0.5)
 #define _fround(v)  (float)((int)((v < 0.0) ? v - 0.5 : v + 0.5))
 
-void setupCodeMap(unsigned short mCodeMap[1190]) {
-	memset(mCodeMap, 0, sizeof(unsigned short)*1190);
-	unsigned short i=0;
-	mCodeMap[31]=i++;mCodeMap[47]=i++	;mCodeMap[55]=i++	;mCodeMap[59]=i++;
-	mCodeMap[61]=i++	;mCodeMap[79]=i++		;mCodeMap[87]=i++		;mCodeMap[91]=i++;
-	mCodeMap[93]=i++	;mCodeMap[103]=i++	;mCodeMap[107]=i++	;mCodeMap[109]=i++;
-	mCodeMap[115]=i++;mCodeMap[117]=i++	;mCodeMap[121]=i++	;mCodeMap[143]=i++;
-	mCodeMap[151]=i++;mCodeMap[155]=i++	;mCodeMap[157]=i++	;mCodeMap[167]=i++;
-	mCodeMap[171]=i++;mCodeMap[173]=i++	;mCodeMap[179]=i++	;mCodeMap[181]=i++;
-	mCodeMap[185]=i++;mCodeMap[199]=i++	;mCodeMap[203]=i++	;mCodeMap[205]=i++;
-	mCodeMap[211]=i++;mCodeMap[213]=i++	;mCodeMap[217]=i++	;mCodeMap[227]=i++;
-	mCodeMap[229]=i++;mCodeMap[233]=i++	;mCodeMap[241]=i++	;mCodeMap[271]=i++;
-	mCodeMap[279]=i++;mCodeMap[283]=i++	;mCodeMap[285]=i++	;mCodeMap[295]=i++;
-	mCodeMap[299]=i++;mCodeMap[301]=i++	;mCodeMap[307]=i++	;mCodeMap[309]=i++;
-	mCodeMap[313]=i++;mCodeMap[327]=i++	;mCodeMap[331]=i++	;mCodeMap[333]=i++;
-	mCodeMap[339]=i++;mCodeMap[341]=i++	;mCodeMap[345]=i++	;mCodeMap[355]=i++;
-	mCodeMap[357]=i++;mCodeMap[361]=i++	;mCodeMap[369]=i++	;mCodeMap[391]=i++;
-	mCodeMap[395]=i++;mCodeMap[397]=i++	;mCodeMap[403]=i++	;mCodeMap[405]=i++;
-	mCodeMap[409]=i++;mCodeMap[419]=i++	;mCodeMap[421]=i++	;mCodeMap[425]=i++;	;mCodeMap[433]=i++;
-	mCodeMap[453]=i++;mCodeMap[457]=i++	;mCodeMap[465]=i++	;mCodeMap[551]=i++;
-	mCodeMap[555]=i++;mCodeMap[557]=i++	;mCodeMap[563]=i++	;mCodeMap[565]=i++;
-	mCodeMap[569]=i++;mCodeMap[583]=i++	;mCodeMap[587]=i++	;mCodeMap[589]=i++;
-	mCodeMap[595]=i++;mCodeMap[597]=i++	;mCodeMap[601]=i++	;mCodeMap[611]=i++;
-	mCodeMap[613]=i++;mCodeMap[617]=i++	;mCodeMap[651]=i++	;mCodeMap[653]=i++;
-	mCodeMap[659]=i++;mCodeMap[661]=i++	;mCodeMap[665]=i++	;mCodeMap[675]=i++;
-	mCodeMap[677]=i++;mCodeMap[681]=i++	;mCodeMap[713]=i++	;mCodeMap[793]=i++;
-	mCodeMap[805]=i++;mCodeMap[809]=i++	;mCodeMap[841]=i++	;mCodeMap[1171]=i++;
-	mCodeMap[1173]=i++;mCodeMap[1189]=i++;
+// Confidence above which a reading is accepted without trying further
+// arc and unit adjustments (97% of a crisp 13 sector reading)
+static const int CONFIDENT = (int)(13 * 7 * 0xff * 0.97f);
+
+// Half the side of the square window averaged by the INTEGRAL threshold
+static const int INTEGRAL_RADIUS = 15;
+
+// Sample positions in Code::readCode are computed in Q16.16 fixed point
+static const int FIX_SHIFT = 16;
+static const int FIX_HALF = 1 << (FIX_SHIFT - 1);
+static const double FIX_ONE = (double)(1 << FIX_SHIFT);
+
+//----------------------------------------
+// Sector directions in fixed point for each
+// arc adjustment tried by Code::sweepArcs
+// (-1 to _ARCS steps of ARC / _ARCS, stored
+// at index step + 1), so readCode needs no
+// trig or float conversions per sample.
+// ARC is worked out as in the Code constructor.
+//----------------------------------------
+struct Directions {
+	enum { SECTORS = 13, ARCS = TopCodes::Code::_ARCS };
+	int dx[ARCS + 2][SECTORS];
+	int dy[ARCS + 2][SECTORS];
+
+	Directions() {
+		float PI = 22.0f/7.0f;
+		float ARC = 2.0f*PI/SECTORS;
+		float dARC = ARC/(float)ARCS;
+		for (int a = -1; a <= ARCS; a++) {
+			for (int sector = 0; sector < SECTORS; sector++) {
+				float angle = ARC * sector + a * dARC;
+				dx[a + 1][sector] = (int)floor(cos(angle) * FIX_ONE + 0.5);
+				dy[a + 1][sector] = (int)floor(sin(angle) * FIX_ONE + 0.5);
+			}
+		}
+	}
+};
+
+static const Directions DIRECTIONS;
+
+//----------------------------------------
+// Classification of every 13 bit data ring
+// reading: the lowest rotation of the bits
+// (-1 if they do not have exactly 5 bits
+// set), how many left rotations get there,
+// and the dense 0..98 id of the lowest
+// rotation in ascending code order (0xff if
+// not a TopCode).  Built once so decode and
+// code_map only need a single lookup.
+// cpp/TopCode.cpp has its own copy, as
+// this tree is built separately (Visual
+// Studio, C++98); keep them in sync.
+//----------------------------------------
+struct CodeTable {
+	enum { SECTORS = 13, CODES = 1 << SECTORS };
+	short         canonical[CODES];
+	unsigned char rotation[CODES];
+	unsigned char id[CODES];
+
+	CodeTable() {
+		int next = 0;
+		for (int bits = 0; bits < CODES; bits++) {
+			int ones = 0;
+			for (int i = 0; i < SECTORS; i++) {
+				ones += (bits >> i) & 1;
+			}
+			canonical[bits] = -1;
+			rotation[bits] = 0;
+			id[bits] = 0xff;
+			if (ones != 5) continue;
+
+			int min = bits;
+			int b = bits;
+			for (int i = 1; i < SECTORS; i++) {
+				b = ((b << 1) & (CODES - 1)) | (b >> (SECTORS - 1));
+				if (b < min) {
+					min = b;
+					rotation[bits] = (unsigned char)i;
+				}
+			}
+			// the lowest rotation is never above bits, so it already
+			// has its id unless it is bits itself
+			canonical[bits] = (short)min;
+			id[bits] = (min == bits) ? (unsigned char)next++ : id[min];
+		}
+	}
 };
 
+static const CodeTable CODE_TABLE;
+
 static bool savePgmImage(char *pixels, size_t width, size_t height, size_t bytesPerPixel, const char *filename) {
   FILE *f = fopen(filename, "wb");
   if (NULL == f) {
@@ -70,6 +138,7 @@ namespace TopCodes {
 		if (unit < 0) return -1;
 		int c = 0;
 		int maxc = 0;
+		int maxcode = -1;
 		float arca;
 		float maxa = 0;
 		float maxu = 0;
@@ -77,65 +146,128 @@ namespace TopCodes {
 		//-----------------------------------------
 		// Try different unit and arc adjustments,
 		// save the one that produces a maximum
-		// confidence reading...
+		// confidence reading. The measured unit
+		// goes first; the adjusted units are only
+		// tried if it gives no confident reading.
 		//-----------------------------------------
-		int ARCS=10;
-		float dARC = 1.0f/(float)ARCS;
-		float hdARC = dARC/2.0f;
-		for (int u = -2; u <= 2; u++) { 
-		 for (int a = 0; a < ARCS; a++) {
-			arca = a * ARC * dARC;
-			c = readCode(scanner, unit + (unit * hdARC * u), arca);
+		static const int UNIT_STEPS[] = { 0, -1, 1, -2, 2 };
+		float hdARC = 0.5f/(float)_ARCS;
+		float u;
+		for (int k = 0; k < 5 && maxc < CONFIDENT; k++) { 
+			u = unit + (unit * hdARC * UNIT_STEPS[k]);
+			c = sweepArcs(scanner, u, arca);
 			if (c > maxc) { 
-			   maxc = c;
-			   maxa = arca;
-			   maxu = unit + (unit * hdARC * u);
+				maxc = c;
+				maxa = arca;
+				maxu = u;
+				maxcode = this->code;
 			}
-		 }
 		}
 		 
-		// One last call to readCode to reset orientation and code
 		if (maxc > 0) {
-		 unit = maxu;
-		 readCode(scanner, unit, maxa);
-		 this->code = rotateLowest(code, maxa);
+			unit = maxu;
+			this->code = rotateLowest(maxcode, maxa);
+		}
+		else {
+			this->code = -1;
 		}
 		return this->code;
    }
 
-	int Code::readCode(Scanner &scanner, float unit, float arca) {
+	int Code::sweepArcs(Scanner &scanner, float unit, float &maxa) {
+		int c = 0;
+		int maxc = 0;
+		int maxcode = -1;
+		int best = 0;
+		float dARC = ARC/(float)_ARCS;
 
-      float dx, dy;  // direction vector
-      float dist;
+		// coarse pass over every other arc adjustment
+		for (int a = 0; a < _ARCS && maxc < CONFIDENT; a += 2) {
+			c = readCode(scanner, unit, a);
+			if (c > maxc) {
+				maxc = c;
+				maxcode = this->code;
+				best = a;
+			}
+		}
+
+		// refine around the best coarse reading
+		if (maxc > 0 && maxc < CONFIDENT) {
+			int center = best;
+			for (int a = center - 1; a <= center + 1; a += 2) {
+				c = readCode(scanner, unit, a);
+				if (c > maxc) {
+					maxc = c;
+					maxcode = this->code;
+					best = a;
+				}
+			}
+		}
+
+		this->code = maxcode;
+		maxa = best * dARC;
+		return maxc;
+	}
+
+	//----------------------------------------
+	// The i-th sample across the diameter, where
+	// (sx, sy) is sample 0 and (ux, uy) one unit
+	// along the sector direction, in Q16.16
+	//----------------------------------------
+	inline int Code::sampleCore(Scanner &scanner, int sx, int sy, int ux, int uy, int i) {
+		return scanner.getSample3x3((sx + i * ux) >> FIX_SHIFT, (sy + i * uy) >> FIX_SHIFT);
+	}
+
+	int Code::readCode(Scanner &scanner, float unit, int arc) {
+
+      const int *dirx = DIRECTIONS.dx[arc + 1];
+      const int *diry = DIRECTIONS.dy[arc + 1];
+      const int fx = (int)(x * FIX_ONE);
+      const int fy = (int)(y * FIX_ONE);
+      const long long fu = (long long)(unit * FIX_ONE);
+      int ux, uy, sx, sy;
       int c = 0;
-      int sx, sy;
       int bit, bits = 0;
+      int ones = 0;
       this->code = -1;
 
       for (int sector = SECTORS-1; sector >= 0; sector--) {
-         dx = (float)cos(ARC * sector + arca);
-         dy = (float)sin(ARC * sector + arca);
+         // One unit along the sector direction, and sample 0 three and
+         // a half units back from the center (plus a half to round to
+         // the nearest pixel)
+         ux = (int)((dirx[sector] * fu) >> FIX_SHIFT);
+         uy = (int)((diry[sector] * fu) >> FIX_SHIFT);
+         sx = fx - ((7 * ux) >> 1) + FIX_HALF;
+         sy = fy - ((7 * uy) >> 1) + FIX_HALF;
       
-         // Take 8 samples across the diameter of the symbol
-         for (int i=0; i<WIDTH; i++) {
-            dist = (i - 3.5f) * unit;
+         // Take the samples across the diameter of the symbol from the
+         // bulls-eye outwards, giving up at the first ring that fails
 
-            sx = (int)_fround(x + dx * dist);
-            sy = (int)_fround(y + dy * dist);
-            core[i] = scanner.getSample3x3(sx, sy);
-         }
-
-         // white rings
-         if (core[1] <= 128 || core[3] <= 128 ||
-             core[4] <= 128 || core[6] <= 128) {
+         // white bulls-eye
+         core[3] = sampleCore(scanner, sx, sy, ux, uy, 3);
+         core[4] = sampleCore(scanner, sx, sy, ux, uy, 4);
+         if (core[3] <= 128 || core[4] <= 128) {
             return 0;
          }
 
          // black ring
+         core[2] = sampleCore(scanner, sx, sy, ux, uy, 2);
+         core[5] = sampleCore(scanner, sx, sy, ux, uy, 5);
          if (core[2] > 128 || core[5] > 128) {
             return 0;
          }
 
+         // white ring
+         core[1] = sampleCore(scanner, sx, sy, ux, uy, 1);
+         core[6] = sampleCore(scanner, sx, sy, ux, uy, 6);
+         if (core[1] <= 128 || core[6] <= 128) {
+            return 0;
+         }
+
+         // data rings
+         core[7] = sampleCore(scanner, sx, sy, ux, uy, 7);
+         core[0] = sampleCore(scanner, sx, sy, ux, uy, 0);
+
          // compute confidence in core sample
          c += (core[1] + core[3] + core[4] + core[6] + // white rings
                (0xff - core[2]) + (0xff - core[5]));  // black ring
@@ -147,6 +279,10 @@ namespace TopCodes {
          c += (0xff - abs(core[0] * 2 - 0xff));
 
          bit = (core[7] > 128)? 1 : 0;
+         ones += bit;
+         if (ones > 5) {
+            return 0;
+         }
          bits <<= 1;
          bits += bit;
       }
@@ -160,26 +296,15 @@ namespace TopCodes {
    }
 
 	int Code::rotateLowest(int bits, float arca) {
-      int min = bits;
-      int mask = 0x1fff;
+      bits &= 0x1fff;
 
       // slightly overcorrect arc-adjustment
       // ideal correction would be (ARC / 2),
       // but there seems to be a positive bias
       // that falls out of the algorithm.
       arca -= (ARC * 0.65f);      
-      this->orientation = 0;
-      for (int i=1; i<=SECTORS; i++) {
-         bits = (((bits << 1) & mask) |
-                 (bits >> (SECTORS - 1)));
-         if (bits < min) { 
-            min = bits;
-            this->orientation = (i * -ARC);
-         }
-      }
-
-      this->orientation += arca;
-      return min;
+      this->orientation = (CODE_TABLE.rotation[bits] * -ARC) + arca;
+      return CODE_TABLE.canonical[bits];
    }   
 	int Scanner::getSample3x3(int x, int y) {
 		int w=image->width;
@@ -197,12 +322,7 @@ namespace TopCodes {
 		return (sum / 9);
    }
 	bool Code::checksum(int bits) {
-      int sum = 0;
-      for (int i=0; i<SECTORS; i++) {
-         sum += (bits & 0x01);
-         bits = bits >> 1;
-      }
-      return (sum == 5);
+      return CODE_TABLE.canonical[bits & 0x1fff] >= 0;
    }
 
 	float Code::readUnit(Scanner &scanner) { 
@@ -320,12 +440,12 @@ namespace TopCodes {
       return -1;
    }
 
-   Scanner::Scanner(): gData(NULL), 
+   Scanner::Scanner(ThresholdMode mode): gData(NULL), 
 
 	   spotMap(NULL), maxu(MAXU), image(NULL),
-	   mCodeFactory(NULL)
+	   mMaskWidth(0), mMaskHeight(0), mSpanWidth(0), mSpanHeight(0),
+	   mThresholdMode(mode), mIntegral(NULL), mCodeFactory(NULL)
    {
-	   setupCodeMap(mCodeMap);
    }
    Scanner::~Scanner() {
 	   clear();
@@ -335,10 +455,157 @@ namespace TopCodes {
    		 free(gData);
 		 free(spotMap);
 	   }
+	   if (mIntegral != NULL) {
+		 free(mIntegral);
+	   }
 	   spotMap = NULL;
 	   gData = NULL;
+	   mIntegral = NULL;
    }
 
+	void Scanner::setMask(const Image *mask) {
+		if (NULL == mask) {
+			clearMask();
+			return;
+		}
+		mMaskWidth = mask->width;
+		mMaskHeight = mask->height;
+		mMask.resize(mMaskWidth * mMaskHeight);
+		for (int j=0; j<mMaskHeight; j++) {
+			memcpy(&mMask[j * mMaskWidth], mask->ucdata + j * mask->widthStep, mMaskWidth);
+		}
+		mPolygon.clear();
+		mSpanWidth = mSpanHeight = 0;
+	}
+
+	void Scanner::setMask(const float *xy, int n) {
+		mPolygon.assign(xy, xy + 2 * n);
+		mMask.clear();
+		mMaskWidth = mMaskHeight = 0;
+		mSpanWidth = mSpanHeight = 0;
+	}
+
+	bool Scanner::loadMask(const char *filename) {
+		FILE *f = fopen(filename, "rb");
+		if (NULL == f) {
+			fprintf(stderr, "Error: Failed to open mask file:%s\n", filename);
+			return false;
+		}
+
+		// a P5 PGM as written by savePgmImage
+		char magic[3] = { 0, 0, 0 };
+		int width, height, maxval;
+		if (fread(magic, 1, 2, f) == 2 && 0 == strcmp(magic, "P5") &&
+			fscanf(f, "%d %d %d", &width, &height, &maxval) == 3 &&
+			width > 0 && height > 0 && maxval < 256) {
+			fgetc(f); // the single whitespace before the pixels
+			std::vector<unsigned char> pixels(width * height);
+			bool ok = (fread(&pixels[0], 1, pixels.size(), f) == pixels.size());
+			fclose(f);
+			if (!ok) return false;
+			Image mask = { &pixels[0], width, height, width };
+			setMask(&mask);
+			return true;
+		}
+
+		// otherwise polygon vertices, one per line
+		rewind(f);
+		std::vector<float> xy;
+		float x, y;
+		while (fscanf(f, "%f %f", &x, &y) == 2) {
+			xy.push_back(x);
+			xy.push_back(y);
+		}
+		fclose(f);
+		if (xy.size() < 6) return false;
+		setMask(&xy[0], (int)xy.size() / 2);
+		return true;
+	}
+
+	void Scanner::clearMask() {
+		mMask.clear();
+		mPolygon.clear();
+		mMaskWidth = mMaskHeight = 0;
+		mSpanWidth = mSpanHeight = 0;
+	}
+
+	/** Turns the mask into the spans of each row for images of the size
+		being scanned, unless they are already made for that size. Without
+		a mask every row is a single span.
+	*/
+	void Scanner::makeSpans() {
+		int w=image->width;
+		int h=image->height;
+		if (w == mSpanWidth && h == mSpanHeight) return;
+		mSpanWidth = w;
+		mSpanHeight = h;
+		mSpanRow.resize(h + 1);
+		mSpanX.clear();
+		mSpanTop = h;
+		mSpanBottom = 0;
+		mSpanLeft = w;
+		mSpanRight = 0;
+
+		std::vector<float> cross;
+		for (int j=0; j<h; j++) {
+			size_t first = mSpanX.size();
+			mSpanRow[j] = (int)first / 2;
+
+			if (!mPolygon.empty()) {
+				//----------------------------------------
+				// Crossings of the edges with the row's
+				// pixel centers, paired up even-odd
+				//----------------------------------------
+				int n = (int)mPolygon.size() / 2;
+				float cy = j + 0.5f;
+				cross.clear();
+				for (int e=0; e<n; e++) {
+					float x0 = mPolygon[2 * e], y0 = mPolygon[2 * e + 1];
+					float x1 = mPolygon[2 * ((e + 1) % n)], y1 = mPolygon[2 * ((e + 1) % n) + 1];
+					if ((y0 <= cy) != (y1 <= cy)) {
+						cross.push_back(x0 + (cy - y0) * (x1 - x0) / (y1 - y0));
+					}
+				}
+				std::sort(cross.begin(), cross.end());
+				for (size_t c=0; c+1<cross.size(); c+=2) {
+					int a = (int)ceil(cross[c] - 0.5f);
+					int b = (int)ceil(cross[c + 1] - 0.5f);
+					if (a < 0) a = 0;
+					if (b > w) b = w;
+					if (a < b) {
+						mSpanX.push_back(a);
+						mSpanX.push_back(b);
+					}
+				}
+			}
+			else {
+				// the nearest mask pixel, if there is a mask
+				const unsigned char *m = NULL;
+				if (!mMask.empty()) m = &mMask[0] + ((j * mMaskHeight) / h) * mMaskWidth;
+				int i = 0;
+				while (i < w) {
+					while (i < w && m != NULL && m[(i * mMaskWidth) / w] == 0) i++;
+					if (i == w) break;
+					int a = i;
+					while (i < w && (m == NULL || m[(i * mMaskWidth) / w] != 0)) i++;
+					mSpanX.push_back(a);
+					mSpanX.push_back(i);
+				}
+			}
+
+			if (mSpanX.size() > first) {
+				if (mSpanTop > j) mSpanTop = j;
+				mSpanBottom = j + 1;
+				if (mSpanLeft > mSpanX[first]) mSpanLeft = mSpanX[first];
+				if (mSpanRight < mSpanX.back()) mSpanRight = mSpanX.back();
+			}
+		}
+		mSpanRow[h] = (int)mSpanX.size() / 2;
+
+		// nothing unmasked at all
+		if (mSpanBottom == 0) mSpanTop = mSpanLeft = 0;
+	}
+
 	std::vector<Code*> Scanner::scan(	const Image  *image, 
 									ScanListener *l, 
 									Image        *annotate) {
@@ -355,37 +622,122 @@ namespace TopCodes {
 		TIME_COMMAND("findCodes", codes = findCodes(l);)
 		return codes;
 	}
+   //----------------------------------------
+   // State of the search for black-white-black
+   // runs along one row
+   //----------------------------------------
+   struct RunState {
+      int level, b1, w1, b2;
+   };
+
+   //----------------------------------------
+   // Feeds the next binary pixel a (0 black,
+   // 1 white) to the run search.  Returns how
+   // far back lies the center of a run that
+   // could be a bulls-eye, or 0
+   //----------------------------------------
+   static inline int nextRun(RunState &s, int a, int maxu) {
+      int dk = 0;
+      switch (s.level) {
+         
+      // On a white region. No black pixels yet
+      case 0:
+         if (a == 0) {  // First black encountered
+            s.level = 1;
+            s.b1 = 1;
+            s.w1 = 0;
+            s.b2 = 0;
+         }
+         break;
+
+      // On first black region
+      case 1:
+         if (a == 0) {
+            s.b1++;
+         } else {
+            s.level = 2;
+            s.w1 = 1;
+         }
+         break;
+
+      // On second white region (bulls-eye of a code?)
+      case 2:
+         if (a == 0) {
+            s.level = 3;
+            s.b2 = 1;
+         } else {
+            s.w1++;
+         }
+         break;
+         
+      // On second black region
+      case 3:
+         if (a == 0) {
+            s.b2++;
+         }
+         // This could be a top code
+         else {
+            int b1 = s.b1, w1 = s.w1, b2 = s.b2;
+            if (b1 >= 2 && b2 >= 2 &&  // less than 2 pixels... not interested
+                b1 <= maxu && b2 <= maxu && w1 <= (maxu + maxu) &&
+                abs(b1 + b2 - w1) <= (b1 + b2) &&
+                abs(b1 + b2 - w1) <= w1 &&
+                abs(b1 - b2) <= b1 &&
+                abs(b1 - b2) <= b2) {
+               dk = 1 + b2 + w1/2;
+            }
+            s.b1 = b2;
+            s.w1 = 1;
+            s.b2 = 0;
+            s.level = 2;
+         }
+         break;
+      }
+      return dk;
+   }
+
 	void Scanner::threshold() {
 
+      makeSpans();
+
+      if (mThresholdMode == INTEGRAL) {
+         thresholdIntegral();
+         return;
+      }
+
       int threshold, sum = 128;
       int s = 30;
       int k;
-      int b1, w1, b2, level, dk;
+      int dk;
 	  int w=image->width;
-	  int h=image->height;
 	  float f = 0.975f;
 	  int r,g,b,a;
 
-	  // copy one byte to 4 bytes
-	  k=0;
-	  for (int j=0; j<h; j++) 
-		  for (int i=0; i<w; i++) {
-			r = g = b = image->ucdata[k];
-			gData[k] = (r<<16) | (g<<8) | (b);
-			++k;
-		  }
+	  // copy one byte to 4 bytes, inside the spans
+	  for (int j=mSpanTop; j<mSpanBottom; j++) 
+		  for (int sp=mSpanRow[j]; sp<mSpanRow[j + 1]; sp++)
+			  for (k=j*w+mSpanX[2*sp]; k<j*w+mSpanX[2*sp + 1]; k++) {
+				r = g = b = image->ucdata[k];
+				gData[k] = (r<<16) | (g<<8) | (b);
+			  }
 
 	  int pixel;
-	  k=0;
-      for (int j=0; j<h; j++) {
-         level = b1 = b2 = w1 = 0;
+      for (int j=mSpanTop; j<mSpanBottom; j++) {
+       int first = mSpanRow[j];
+       int last = mSpanRow[j + 1];
+       for (int n=0; n<last-first; n++) {
          //----------------------------------------
          // Process rows back and forth (alternating
-         // left-to-right, right-to-left)
+         // left-to-right, right-to-left), so the
+         // spans of odd rows are taken last first
          //----------------------------------------
-         k = (j % 2 == 0) ? 0 : w-1;
+         int sp = (j % 2 == 0) ? first + n : last - 1 - n;
+         int x0 = mSpanX[2*sp];
+         int x1 = mSpanX[2*sp + 1];
+         RunState runs = { 0, 0, 0, 0 };
+         k = (j % 2 == 0) ? x0 : x1-1;
          k += (j * w);         
-         for (int i=0; i<w; i++) { 
+         for (int i=x0; i<x1; i++) { 
             pixel = gData[k];           
             r = (pixel >> 16) & 0xff;
             g = (pixel >> 8) & 0xff;
@@ -399,9 +751,11 @@ namespace TopCodes {
             sum += a - (sum / s);
          
             //----------------------------------------
-            // Factor in sum from the previous row
+            // Factor in sum from the previous row, if
+            // it was thresholded there (the running
+            // sum never drops to 0)
             //----------------------------------------
-            if (k >= w) {
+            if (k >= w && (gData[k-w] & 0xffffff)) {
                threshold = (sum + (gData[k-w] & 0xffffff)) / (2*s);
             } else {
                threshold = sum / s;
@@ -421,81 +775,180 @@ namespace TopCodes {
             //----------------------------------------
             gData[k] = (a << 24) + (sum & 0xffffff);
 
-            switch (level) {
-               
-            // On a white region. No black pixels yet
-            case 0:
-               if (a == 0) {  // First black encountered
-                  level = 1;
-                  b1 = 1;
-                  w1 = 0;
-                  b2 = 0;
-               }
-               break;
-
-            // On first black region
-            case 1:
-               if (a == 0) {
-                  b1++;
-               } else {
-                  level = 2;
-                  w1 = 1;
-               }
-               break;
-
-            // On second white region (bulls-eye of a code?)
-            case 2:
-               if (a == 0) {
-                  level = 3;
-                  b2 = 1;
-               } else {
-                  w1++;
-               }
-               break;
-               
-            // On second black region
-            case 3:
-               if (a == 0) {
-                  b2++;
-               }
-               // This could be a top code
-               else {
-                  int mask;
-                  if (b1 >= 2 && b2 >= 2 &&  // less than 2 pixels... not interested
-                      b1 <= maxu && b2 <= maxu && w1 <= (maxu + maxu) &&
-                      abs(b1 + b2 - w1) <= (b1 + b2) &&
-                      abs(b1 + b2 - w1) <= w1 &&
-                      abs(b1 - b2) <= b1 &&
-                      abs(b1 - b2) <= b2) {
-                     mask = 0x2000000;
-
-                     dk = 1 + b2 + w1/2;
-                     if (j % 2 == 0) {
-                        dk = k - dk; 
-                     } else {
-                        dk = k + dk;
-                     }
-                     
-                     gData[dk - 1] |= mask;
-                     gData[dk    ] |= mask;
-                     gData[dk + 1] |= mask;
-                  }
-                  b1 = b2;
-                  w1 = 1;
-                  b2 = 0;
-                  level = 2;
-               }
-               break;
+            //----------------------------------------
+            // Mark the center of a possible bulls-eye
+            //----------------------------------------
+            dk = nextRun(runs, a, maxu);
+            if (dk > 0) {
+               dk = (j % 2 == 0) ? k - dk : k + dk;
+               gData[dk - 1] |= 0x2000000;
+               gData[dk    ] |= 0x2000000;
+               gData[dk + 1] |= 0x2000000;
             }
             k += (j % 2 == 0) ? 1 : -1;
          }
+       }
+      }
+   }
+
+   //----------------------------------------
+   // Threshold each pixel against the mean of
+   // the square window of side 2 * RADIUS + 1
+   // around it, clipped at the image border.
+   // Rows are independent once the summed-area
+   // table is built, so they are binarized and
+   // searched for bulls-eyes in parallel.  The
+   // table only covers what the windows of the
+   // spans reach.
+   //----------------------------------------
+   void Scanner::thresholdIntegral() {
+      int w = image->width;
+      int h = image->height;
+      int r = INTEGRAL_RADIUS;
+
+      integrate((mSpanTop - r < 0) ? 0 : mSpanTop - r,
+                (mSpanBottom + r > h) ? h : mSpanBottom + r,
+                (mSpanLeft - r < 0) ? 0 : mSpanLeft - r,
+                (mSpanRight + r > w) ? w : mSpanRight + r);
+
+      #pragma omp parallel for schedule(static)
+      for (int j=mSpanTop; j<mSpanBottom; j++) {
+         int y0 = (j - r < 0) ? 0 : j - r;
+         int y1 = (j + r + 1 > h) ? h : j + r + 1;
+         const unsigned int *top = mIntegral + y0 * (w + 1);
+         const unsigned int *bot = mIntegral + y1 * (w + 1);
+
+        for (int sp=mSpanRow[j]; sp<mSpanRow[j + 1]; sp++) {
+         RunState runs = { 0, 0, 0, 0 };
+         int k = j * w + mSpanX[2*sp];
+
+         for (int i=mSpanX[2*sp]; i<mSpanX[2*sp + 1]; i++, k++) {
+            int x0 = (i - r < 0) ? 0 : i - r;
+            int x1 = (i + r + 1 > w) ? w : i + r + 1;
+            unsigned int area = (x1 - x0) * (y1 - y0);
+
+            // unsigned wrap-around keeps the window sum exact
+            unsigned int sum = bot[x1] - bot[x0] - top[x1] + top[x0];
+
+            //----------------------------------------
+            // Black if below 97.5% of the window mean
+            // (same factor as the Wellner threshold)
+            //----------------------------------------
+            unsigned int pixel = image->ucdata[k];
+            int a = (pixel * area * 40 < sum * 39) ? 0 : 1;
+            gData[k] = (a << 24) + (sum / area);
+
+            int dk = nextRun(runs, a, maxu);
+            if (dk > 0) {
+               gData[k - dk - 1] |= 0x2000000;
+               gData[k - dk    ] |= 0x2000000;
+               gData[k - dk + 1] |= 0x2000000;
+            }
+         }
+        }
+      }
+   }
+
+   //----------------------------------------
+   // Row prefix sums, 16 pixels at a time with
+   // SSE2: pixels are widened to 16 bit lanes,
+   // summed in log steps within the register,
+   // widened to 32 bit and offset by the total
+   // of the row so far
+   //----------------------------------------
+   static void prefixRow(const unsigned char *src, unsigned int *dst, int n) {
+      unsigned int total = 0;
+      int i = 0;
+#ifdef TOPCODES_SSE2
+      const __m128i zero = _mm_setzero_si128();
+      __m128i carry = zero;
+      for (; i + 16 <= n; i += 16) {
+         __m128i v  = _mm_loadu_si128((const __m128i *)(src + i));
+         __m128i lo = _mm_unpacklo_epi8(v, zero);
+         __m128i hi = _mm_unpackhi_epi8(v, zero);
+         lo = _mm_add_epi16(lo, _mm_slli_si128(lo, 2));
+         hi = _mm_add_epi16(hi, _mm_slli_si128(hi, 2));
+         lo = _mm_add_epi16(lo, _mm_slli_si128(lo, 4));
+         hi = _mm_add_epi16(hi, _mm_slli_si128(hi, 4));
+         lo = _mm_add_epi16(lo, _mm_slli_si128(lo, 8));
+         hi = _mm_add_epi16(hi, _mm_slli_si128(hi, 8));
+
+         // carry the last lane of the low half into the high half
+         __m128i last = _mm_shufflehi_epi16(lo, 0xff);
+         hi = _mm_add_epi16(hi, _mm_unpackhi_epi64(last, last));
+
+         __m128i s0 = _mm_add_epi32(carry, _mm_unpacklo_epi16(lo, zero));
+         __m128i s1 = _mm_add_epi32(carry, _mm_unpackhi_epi16(lo, zero));
+         __m128i s2 = _mm_add_epi32(carry, _mm_unpacklo_epi16(hi, zero));
+         __m128i s3 = _mm_add_epi32(carry, _mm_unpackhi_epi16(hi, zero));
+         _mm_storeu_si128((__m128i *)(dst + i), s0);
+         _mm_storeu_si128((__m128i *)(dst + i + 4), s1);
+         _mm_storeu_si128((__m128i *)(dst + i + 8), s2);
+         _mm_storeu_si128((__m128i *)(dst + i + 12), s3);
+         carry = _mm_shuffle_epi32(s3, 0xff);
+      }
+      if (i > 0) total = dst[i - 1];
+#endif
+      for (; i < n; i++) {
+         total += src[i];
+         dst[i] = total;
+      }
+   }
+
+   //----------------------------------------
+   // Builds the summed-area table in mIntegral
+   // for the pixels from row top and column
+   // left up to (not including) row bottom and
+   // column right: entry (i + 1, j + 1) is the
+   // sum of those pixels above and left of
+   // (i, j) inclusive, row top and column left
+   // are zero, entries outside are not set.
+   // Row prefix sums are split across threads
+   // by rows, the sums down the columns by
+   // column bands.
+   //----------------------------------------
+   void Scanner::integrate(int top, int bottom, int left, int right) {
+      int w = image->width;
+      int h = image->height;
+      int stride = w + 1;
+      const int BAND = 256;
+
+      if (NULL == mIntegral) {
+         mIntegral = (unsigned int*)malloc((h + 1) * stride * sizeof(unsigned int));
+      }
+      memset(mIntegral + top * stride + left, 0, (right - left + 1) * sizeof(unsigned int));
+
+      #pragma omp parallel for schedule(static)
+      for (int j=top; j<bottom; j++) {
+         unsigned int *row = mIntegral + (j + 1) * stride;
+         row[left] = 0;
+         prefixRow(image->ucdata + j * w + left, row + left + 1, right - left);
+      }
+
+      #pragma omp parallel for schedule(static)
+      for (int b=left; b<=right; b+=BAND) {
+         int n = (right + 1 - b < BAND) ? right + 1 - b : BAND;
+         for (int j=top+1; j<=bottom; j++) {
+            const unsigned int *above = mIntegral + (j - 1) * stride + b;
+            unsigned int *row = mIntegral + j * stride + b;
+            int i = 0;
+#ifdef TOPCODES_SSE2
+            for (; i + 4 <= n; i += 4) {
+               __m128i a = _mm_loadu_si128((const __m128i *)(above + i));
+               __m128i s = _mm_loadu_si128((const __m128i *)(row + i));
+               _mm_storeu_si128((__m128i *)(row + i), _mm_add_epi32(a, s));
+            }
+#endif
+            for (; i < n; i++) {
+               row[i] += above[i];
+            }
+         }
       }
    }
 
    std::vector<Code*> Scanner::findCodes(ScanListener *l) {
 		std::vector<Code*> spots;
 		int w=image->width;
-		int h=image->height;
 		Code *spot = NULL;
 		if (mCodeFactory) {
 			spot = mCodeFactory->create();
@@ -504,52 +957,235 @@ namespace TopCodes {
 			spot = new Code();
 		}
 		if (l) l->onBegin();
-		int k = w * 2;	  // start from third row.
-		unsigned char *spotMapPtr = spotMap+k;
+		findSeeds(mSeeds);
+		unsigned char *spotMapPtr;
 		bool overlap;
-		for (int j=2; j<h-2; j++) {
-			for (int i=0; i<w; i++) {
-				overlap = *spotMapPtr>0; // FAST OVERLAP QUERY 
-				if (!overlap && 
-					(gData[k]  &0x2000000) && 
-					(gData[k-1]&0x2000000) && 
-					(gData[k+1]&0x2000000) && 
-					(gData[k-w]&0x2000000) && 
-					(gData[k+w]&0x2000000)) {
-					spot->decode(*this, i, j);		
-					if (spot->isValid()) {
-						spot->x = i;
-						spot->y = j;
-						// COLOR MAP FOR FAST OVERLAP QUERY 
-						colorSpotMap(i, j, spot, spotMapPtr);
-						if (l) {
-							// use listener
-							if (l->onNewCode(spot)!=0) {
-								return spots;
-							}
-						}
-						else {
-							// no listener
-							spots.push_back(spot);
-						}
-						if (mCodeFactory) {
-							spot = mCodeFactory->create();
-						}
-						else {
-							spot = new Code();
+		for (size_t s=0; s<mSeeds.size(); s++) {
+			int i = mSeeds[s].x;
+			int j = mSeeds[s].y;
+			spotMapPtr = spotMap + j * w + i;
+			overlap = *spotMapPtr>0; // FAST OVERLAP QUERY 
+			if (!overlap) {
+				spot->decode(*this, i, j);		
+				if (spot->isValid()) {
+					spot->x = i;
+					spot->y = j;
+					// COLOR MAP FOR FAST OVERLAP QUERY 
+					colorSpotMap(i, j, spot, spotMapPtr);
+					if (l) {
+						// use listener
+						if (l->onNewCode(spot)!=0) {
+							return spots;
 						}
 					}
 					else {
+						// no listener
+						spots.push_back(spot);
+					}
+					if (mCodeFactory) {
+						spot = mCodeFactory->create();
+					}
+					else {
+						spot = new Code();
 					}
 				}
-				k++;
-				spotMapPtr++;
 			}
 		}
 		if (l) l->onEnd();
 		return spots;
    }	
 
+	//----------------------------------------
+	// Index of the lowest set bit of a non-zero
+	// mask, and the number of bits set in a
+	// four bit mask
+	//----------------------------------------
+	static inline int lowestBit(unsigned int bits) {
+#if defined(__GNUC__)
+		return __builtin_ctz(bits);
+#else
+		int n = 0;
+		while (!(bits & 1)) { bits >>= 1; n++; }
+		return n;
+#endif
+	}
+	static const int BITS4[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+	//----------------------------------------
+	// Bit i of the result is set if pixel k + i
+	// and its four neighbours are all marked as
+	// candidates (four pixels at a time)
+	//----------------------------------------
+	static inline int candidateMask4(const unsigned int *data, int k, int w) {
+		const unsigned int M = 0x2000000;
+#ifdef TOPCODES_SSE2
+		const __m128i mask = _mm_set1_epi32(M);
+		__m128i m = _mm_loadu_si128((const __m128i *)(data + k));
+		m = _mm_and_si128(m, _mm_loadu_si128((const __m128i *)(data + k - 1)));
+		m = _mm_and_si128(m, _mm_loadu_si128((const __m128i *)(data + k + 1)));
+		m = _mm_and_si128(m, _mm_loadu_si128((const __m128i *)(data + k - w)));
+		m = _mm_and_si128(m, _mm_loadu_si128((const __m128i *)(data + k + w)));
+		m = _mm_cmpeq_epi32(_mm_and_si128(m, mask), mask);
+		return _mm_movemask_ps(_mm_castsi128_ps(m));
+#else
+		int bits = 0;
+		for (int i=0; i<4; i++, k++) {
+			if ((data[k]   & M) && 
+				(data[k-1] & M) && 
+				(data[k+1] & M) && 
+				(data[k-w] & M) && 
+				(data[k+w] & M)) bits |= 1 << i;
+		}
+		return bits;
+#endif
+	}
+
+	/** Lists the candidate pixels of the rows findSeeds looks at in
+		mCandidates, so later passes only touch the pixels that matter.
+		Each row is counted, the counts are turned into row offsets in
+		mRowStart by a prefix sum, and then each row writes its pixel
+		indices from its offset.  Rows are counted and written in parallel,
+		and only within the spans of the mask (columns 1 .. w-2).
+	*/
+	void Scanner::compactCandidates() {
+		int w=image->width;
+		int h=image->height;
+		mRowStart.assign(h + 1, 0);
+
+		#pragma omp parallel for schedule(static)
+		for (int j=2; j<h-2; j++) {
+			int k = j * w;
+			int n = 0;
+			for (int sp=mSpanRow[j]; sp<mSpanRow[j + 1]; sp++) {
+				int x0 = (mSpanX[2*sp] < 1) ? 1 : mSpanX[2*sp];
+				int x1 = (mSpanX[2*sp + 1] > w - 1) ? w - 1 : mSpanX[2*sp + 1];
+				for (int i=x0; i<x1; i+=4) {
+					int bits = candidateMask4(gData, k + i, w);
+					if (i + 4 > x1) bits &= (1 << (x1 - i)) - 1;
+					n += BITS4[bits];
+				}
+			}
+			mRowStart[j] = n;
+		}
+
+		int total = 0;
+		for (int j=0; j<=h; j++) {
+			int n = mRowStart[j];
+			mRowStart[j] = total;
+			total += n;
+		}
+		mCandidates.resize(total);
+
+		#pragma omp parallel for schedule(static)
+		for (int j=2; j<h-2; j++) {
+			int k = j * w;
+			int *out = (total > 0) ? &mCandidates[0] + mRowStart[j] : NULL;
+			int bits;
+			for (int sp=mSpanRow[j]; sp<mSpanRow[j + 1]; sp++) {
+				int x0 = (mSpanX[2*sp] < 1) ? 1 : mSpanX[2*sp];
+				int x1 = (mSpanX[2*sp + 1] > w - 1) ? w - 1 : mSpanX[2*sp + 1];
+				for (int i=x0; i<x1; i+=4) {
+					bits = candidateMask4(gData, k + i, w);
+					if (i + 4 > x1) bits &= (1 << (x1 - i)) - 1;
+					while (bits) {
+						*out++ = k + i + lowestBit(bits);
+						bits &= bits - 1;
+					}
+				}
+			}
+		}
+	}
+
+	static int findSeedGroup(std::vector<int> &parent, int g) {
+		while (parent[g] != g) {
+			parent[g] = parent[parent[g]];
+			g = parent[g];
+		}
+		return g;
+	}
+
+	/** Collapses the candidate pixels (marked by threshold() in both scan
+		directions and in the rows above and below) into one seed per
+		bulls-eye.  Adjacent candidate pixels in a row form a run; each
+		run is merged with the runs it touches in the two rows above.
+		Every group gives one seed at its centroid.
+	*/
+	void Scanner::findSeeds(std::vector<Seed> &seeds) {
+		const int GAP = 2;
+		int w=image->width;
+		int h=image->height;
+		std::vector<int>   parent;
+		std::vector<int>   runX0, runX1, runRow;
+		std::vector<float> sumX, sumY, count;
+		std::vector<int>   active;
+		seeds.clear();
+
+		compactCandidates();
+		for (int j=2; j<h-2; j++) {
+			// drop runs that can no longer be reached
+			size_t a = 0;
+			for (size_t r=0; r<active.size(); r++) {
+				if (runRow[active[r]] >= j - GAP) active[a++] = active[r];
+			}
+			active.resize(a);
+			size_t first = parent.size();
+
+			for (int c=mRowStart[j]; c<mRowStart[j + 1]; c++) {
+				int i = mCandidates[c] - j * w;
+
+				// extend the current run or start a new one
+				int g = (int)parent.size() - 1;
+				if (parent.size() > first && runX1[g] >= i - GAP) {
+					runX1[g] = i;
+				}
+				else {
+					g = (int)parent.size();
+					parent.push_back(g);
+					runX0.push_back(i);
+					runX1.push_back(i);
+					runRow.push_back(j);
+					sumX.push_back(0);
+					sumY.push_back(0);
+					count.push_back(0);
+				}
+				sumX[g] += i;
+				sumY[g] += j;
+				count[g] += 1;
+			}
+
+			// merge with the runs touched in the rows above
+			for (size_t g=first; g<parent.size(); g++) {
+				for (size_t r=0; r<active.size(); r++) {
+					int p = active[r];
+					if (runX0[p] <= runX1[g] + GAP && runX1[p] >= runX0[g] - GAP) {
+						int r1 = findSeedGroup(parent, p);
+						int r2 = findSeedGroup(parent, (int)g);
+						if (r1 != r2) parent[r2] = r1;
+					}
+				}
+			}
+			for (size_t g=first; g<parent.size(); g++) active.push_back((int)g);
+		}
+
+		// fold every run into its group and emit the centroids
+		for (size_t g=0; g<parent.size(); g++) {
+			int r = findSeedGroup(parent, (int)g);
+			if (r != (int)g) {
+				sumX[r] += sumX[g];
+				sumY[r] += sumY[g];
+				count[r] += count[g];
+			}
+		}
+		for (size_t g=0; g<parent.size(); g++) {
+			if (parent[g] == (int)g) {
+				Seed seed;
+				seed.x = _iround(sumX[g] / count[g]);
+				seed.y = _iround(sumY[g] / count[g]);
+				seeds.push_back(seed);
+			}
+		}
+	}
+
 	void Scanner::colorSpotMap(int x, int y, Code *spot, unsigned char *spotMapPtr) {
 		int radius = 2*(int)spot->unit;
 		int c0 = (x>=radius) ? radius : x;
@@ -576,7 +1212,11 @@ namespace TopCodes {
 		   fprintf(stderr, "Error in code_map: code should be between 31 and 1189\n");
 		   return 100;
 	   }
-	   return mCodeMap[original_code];
+	   // only the lowest rotation of a code has an id, anything else maps to 0
+	   if (CODE_TABLE.canonical[original_code] != original_code) {
+		   return 0;
+	   }
+	   return CODE_TABLE.id[original_code];
    }
    Code* Code::clone() const {
 	   return new Code(*this);
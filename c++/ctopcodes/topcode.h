@@ -19,10 +19,16 @@ namespace TopCodes {
 		int           widthStep; 
 	};
 
+	/** Center of one group of candidate pixels, one per bulls-eye */
+	struct Seed {
+		int x;
+		int y;
+	};
+
 	class Scanner;
 	class Code {
 	public:
-		enum INFO { _WIDTH=8 };
+		enum INFO { _WIDTH=8, _ARCS=10 };
 		Code();
 		virtual ~Code() {}
 		virtual Code* clone() const;
@@ -37,7 +43,9 @@ namespace TopCodes {
 
 	protected:
 		float       readUnit(Scanner &scanner);
-		int         readCode(Scanner &scanner, float unit, float arca);
+		int         sweepArcs(Scanner &scanner, float unit, float &maxa);
+		int         readCode(Scanner &scanner, float unit, int arc);
+		int         sampleCore(Scanner &scanner, int sx, int sy, int ux, int uy, int i);
 		int         rotateLowest(int bits, float arca);		
 		bool        checksum(int bits);
 		int   SECTORS; /** Number of sectors in the data ring */
@@ -71,7 +79,12 @@ namespace TopCodes {
 	class Scanner {
 	public:
 		enum INFO { MAXU=80 };
-		Scanner();
+		/** How the image is binarized. WELLNER keeps running sums along
+			alternating rows; INTEGRAL compares each pixel to the mean of a
+			square window around it from a summed-area table, so the result
+			does not depend on the order the rows are processed in */
+		enum ThresholdMode { WELLNER, INTEGRAL };
+		Scanner(ThresholdMode mode = WELLNER);
 		virtual ~Scanner();
 		/** all successive calls to this instance should be with an image
 			with the same dimensions as the first given image!
@@ -83,6 +96,22 @@ namespace TopCodes {
 										ScanListener *l = NULL, 
 										Image        *annotate = NULL);
 		void            disposeCodes(std::vector<Code*> &codes);
+		/** Restricts the scan to part of the image, such as the table, so
+			that the rest is never thresholded or searched for bulls-eyes.
+			mask is non-zero where codes can be, and is scaled to the size
+			of the scanned images if it differs. Codes must lie wholly
+			inside the mask. The mask is copied.
+		*/
+		void            setMask(const Image *mask);
+		/** The same for the inside of a polygon of n vertices, given as
+			n x, y pairs in image pixels */
+		void            setMask(const float *xy, int n);
+		/** Reads a mask from a binary (P5) PGM image, or from a text file
+			with one "x y" polygon vertex per line.
+			@return false if the file cannot be read
+		*/
+		bool            loadMask(const char *filename);
+		void            clearMask();
 		void            setCodeFactory(CodeFactory *cf) {mCodeFactory=cf;}
 		int             xdist(int x, int y, int d);
 		int             ydist(int x, int y, int d);
@@ -98,11 +127,32 @@ namespace TopCodes {
 		unsigned short  code_map(unsigned short original_code); 
 	protected:
 		void             threshold();
+		void             makeSpans();
+		void             thresholdIntegral();
+		void             integrate(int top, int bottom, int left, int right);
 		virtual std::vector<Code*> findCodes(ScanListener *l=NULL);
+		void             findSeeds(std::vector<Seed> &seeds);
+		void             compactCandidates();
 		void             colorSpotMap(int x, int y, Code *spot, unsigned char *spotMapPtr);			
 		unsigned char    *spotMap; /** Holds processed binary pixel data */		
 		int              maxu;   /** Maximum width of a TopCode unit in pixels */
-		unsigned short   mCodeMap[1190];
+		std::vector<Seed> mSeeds;
+		std::vector<int> mCandidates; /** Indices of candidate pixels, row by row */
+		std::vector<int> mRowStart;   /** First candidate of each row, then the total */
+		std::vector<unsigned char> mMask; /** Mask bitmap as given, mMaskWidth x mMaskHeight, or empty */
+		int              mMaskWidth, mMaskHeight;
+		std::vector<float> mPolygon;  /** Mask polygon as x, y pairs, or empty */
+		/** Unmasked columns of each row: row j has the spans from
+			mSpanX[2 s] to mSpanX[2 s + 1] (exclusive) for s from
+			mSpanRow[j] up to mSpanRow[j + 1]. Rows before mSpanTop and
+			from mSpanBottom on have none, and all spans lie between
+			columns mSpanLeft and mSpanRight. */
+		std::vector<int> mSpanRow;
+		std::vector<int> mSpanX;
+		int              mSpanTop, mSpanBottom, mSpanLeft, mSpanRight;
+		int              mSpanWidth, mSpanHeight; /** Image size the spans were made for */
+		ThresholdMode    mThresholdMode;
+		unsigned int     *mIntegral; /** Summed-area table, (h+1) x (w+1), INTEGRAL mode only */
 		CodeFactory      *mCodeFactory;
 	};
 }
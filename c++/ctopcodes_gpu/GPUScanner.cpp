@@ -11,7 +11,8 @@ bool cudah2d(unsigned char *host_ptr      , unsigned char *device_ptr     , size
 #define TIME_COMMAND_CUDA(msg, x) CUDA_TIME_START x; CUDA_TIME_REPORT(msg)
 
 TopCodes::GPUScanner::GPUScanner(int w, int h) 
-	: m_dInRunSum(NULL), m_dOut(NULL), mImgW(w), mImgH(h)
+	: m_dInRunSum(NULL), m_dOut(NULL), m_dRowStart(NULL), m_dHits(NULL), m_hHits(NULL), 
+	  mImgW(w), mImgH(h)
 {
 	imgSize = mImgW*mImgH*sizeof(unsigned char);
 	imgSizeOut = mImgW*mImgH*sizeof(unsigned short);
@@ -24,7 +25,15 @@ TopCodes::GPUScanner::GPUScanner(int w, int h)
 		fprintf(stderr, "Error CUDA Malloc\n");
 		return;
 	}
-	if (cudaHostAlloc((void**)&m_hOut, imgSizeOut, cudaHostAllocWriteCombined)!= CUDA_SUCCESS) {
+	if (cudaMalloc((void**)&m_dRowStart, (mImgH+1)*sizeof(unsigned int))!= CUDA_SUCCESS) {
+		fprintf(stderr, "Error CUDA Malloc\n");
+		return;
+	}
+	if (cudaMalloc((void**)&m_dHits, 2*imgSizeRunSum)!= CUDA_SUCCESS) {
+		fprintf(stderr, "Error CUDA Malloc\n");
+		return;
+	}
+	if (cudaHostAlloc((void**)&m_hHits, 2*imgSizeRunSum, cudaHostAllocDefault)!= CUDA_SUCCESS) {
 		fprintf(stderr, "Error CUDA Malloc\n");
 		return;
 	}	
@@ -50,29 +59,24 @@ TopCodes::GPUScanner::scan(const Image *image, ScanListener *l, Image *annotate)
 	TIME_COMMAND_CUDA("h2d"      , cudah2d((unsigned char*)gData, m_dInRunSum, imgSizeRunSum);)
 	TIME_COMMAND_CUDA("memset"   , cudaMemset(m_dOut, 0, imgSizeOut);)
 	TIME_COMMAND_CUDA("compute"  , gpu_scanner_compute((const unsigned int*)m_dInRunSum, (unsigned short*)m_dOut, mImgW, mImgH);)
-	TIME_COMMAND_CUDA("d2h"      , cudad2h(m_dOut, (unsigned char*)m_hOut, imgSizeOut);)
+	TIME_COMMAND_CUDA("compact"  , gpu_scanner_compact((const unsigned short*)m_dOut, m_dRowStart, m_dHits, mImgW, mImgH);)
+
+	// only the hits come back, not the whole frame
+	unsigned int hits = 0;
+	TIME_COMMAND_CUDA("d2h"      , 
+		cudad2h((unsigned char*)(m_dRowStart + mImgH), (unsigned char*)&hits, sizeof(unsigned int));
+		cudad2h((unsigned char*)m_dHits, (unsigned char*)m_hHits, hits*2*sizeof(unsigned int));)
 
-	size_t cnt=0;
 	TopCodes::Code *nc;	
-	int cr0=0,cr=mImgW*mImgH, c=0, r=0;
-	unsigned short *m_hOutPtr = m_hOut;
 	TIME_COMMAND("build-list", 
-	while (cr0<cr) {
-		if (*m_hOutPtr > 0) {
-			nc = new TopCodes::Code();
-			nc->x = c;
-			nc->y = r;
-			nc->code = *m_hOutPtr;
-			nc->unit = 5.0f;
-			topcode_codes.push_back(nc);
-		}
-		++c;
-		if (c>=mImgW) {
-			++r;
-			c=0;
-		}
-		++cr0;
-		++m_hOutPtr;
+	topcode_codes.reserve(hits);
+	for (unsigned int i=0; i<hits; i++) {
+		nc = new TopCodes::Code();
+		nc->x = (float)(m_hHits[2*i] % mImgW);
+		nc->y = (float)(m_hHits[2*i] / mImgW);
+		nc->code = m_hHits[2*i+1];
+		nc->unit = 5.0f;
+		topcode_codes.push_back(nc);
 	}
 	)
 	return topcode_codes;
@@ -80,6 +84,13 @@ TopCodes::GPUScanner::scan(const Image *image, ScanListener *l, Image *annotate)
 void 
 TopCodes::GPUScanner::clear() {
 	cudaFree(m_dOut);
+	cudaFree(m_dRowStart);
+	cudaFree(m_dHits);
+	cudaFreeHost(m_hHits);
+	m_dOut = NULL;
+	m_dRowStart = NULL;
+	m_dHits = NULL;
+	m_hHits = NULL;
 }
 std::vector<TopCodes::Code*> 
 TopCodes::GPUScanner::findCodes(ScanListener *l) {
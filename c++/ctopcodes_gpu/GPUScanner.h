@@ -18,7 +18,8 @@ namespace TopCodes {
 	protected:
 		int            mImgW, mImgH;
 		unsigned char  *m_dInRunSum, *m_dOut;
-		unsigned short *m_hOut;
+		unsigned int   *m_dRowStart; /** First hit of each row, then the number of hits */
+		unsigned int   *m_dHits, *m_hHits; /** Packed (pixel index, code) pairs */
 		size_t         imgSize, imgSizeOut, imgSizeRunSum;
 		cudaArray      *cua_Data;
 	};
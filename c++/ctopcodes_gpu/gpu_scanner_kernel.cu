@@ -7,6 +7,7 @@
 #define COLS_PER_THREAD 16 // 16 gives performance of 45ms
 #define BLOCKWIDTH 16
 #define BLOCKHEIGHT 16
+#define COMPACT_THREADS 128
 
 __device__ inline float _fround(float v) {
 	return (float)((int)((v < 0.0f) ? v - 0.5f : v + 0.5f));
@@ -300,3 +301,106 @@ __host__ void gpu_scanner_compute(const unsigned int *devInRunSum,
 	cuda_krnl_topcodes <<< grid, threads >>> (devInRunSum, devOut, w, h);
 }
 
+//----------------------------------------
+// Compaction of the per-pixel output into a
+// dense list of hits: count the hits of each
+// row, turn the counts into row offsets with
+// a prefix sum, then write each row's hits
+// from its offset. The host then copies back
+// only the hits instead of the whole frame.
+//----------------------------------------
+
+/** one block per row: number of hits in the row */
+__global__ void cuda_krnl_row_counts(const unsigned short *out, 
+									 unsigned int         *rowStart, 
+									 int                  w) {
+	__shared__ unsigned int partial[COMPACT_THREADS];
+	const unsigned short *row = out + blockIdx.x * w;
+	unsigned int n = 0;
+	for (int x=threadIdx.x; x<w; x+=COMPACT_THREADS) {
+		n += (row[x] > 0) ? 1 : 0;
+	}
+	partial[threadIdx.x] = n;
+	__syncthreads();
+	for (int s=COMPACT_THREADS/2; s>0; s>>=1) {
+		if (threadIdx.x < s) 
+			partial[threadIdx.x] += partial[threadIdx.x + s];
+		__syncthreads();
+	}
+	if (threadIdx.x == 0) 
+		rowStart[blockIdx.x] = partial[0];
+}
+
+/** one block: exclusive prefix sum of the row counts in place, total in rowStart[h].
+	Each thread sums a span of rows, the span totals are scanned, then each thread
+	writes the offsets of its own span. */
+__global__ void cuda_krnl_row_offsets(unsigned int *rowStart, 
+									  int          h) {
+	__shared__ unsigned int span[COMPACT_THREADS];
+	int per = DIVUP(h, COMPACT_THREADS);
+	int r0 = threadIdx.x * per;
+	int r1 = min(r0 + per, h);
+	unsigned int sum = 0;
+	for (int r=r0; r<r1; r++) {
+		sum += rowStart[r];
+	}
+	span[threadIdx.x] = sum;
+	__syncthreads();
+	if (threadIdx.x == 0) {
+		unsigned int total = 0;
+		for (int t=0; t<COMPACT_THREADS; t++) {
+			unsigned int s = span[t];
+			span[t] = total;
+			total += s;
+		}
+		rowStart[h] = total;
+	}
+	__syncthreads();
+	unsigned int offset = span[threadIdx.x];
+	for (int r=r0; r<r1; r++) {
+		unsigned int n = rowStart[r];
+		rowStart[r] = offset;
+		offset += n;
+	}
+}
+
+/** one block per row: writes the hits of the row in order, a block wide
+	chunk at a time, placing each one by an inclusive scan of the hit flags */
+__global__ void cuda_krnl_row_hits(const unsigned short *out, 
+								   const unsigned int   *rowStart, 
+								   unsigned int         *hits, 
+								   int                  w) {
+	__shared__ unsigned int flags[COMPACT_THREADS];
+	const unsigned short *row = out + blockIdx.x * w;
+	unsigned int base = rowStart[blockIdx.x];
+	for (int x0=0; x0<w; x0+=COMPACT_THREADS) {
+		int x = x0 + threadIdx.x;
+		unsigned short code = (x < w) ? row[x] : 0;
+		unsigned int flag = (code > 0) ? 1 : 0;
+		flags[threadIdx.x] = flag;
+		__syncthreads();
+		for (int s=1; s<COMPACT_THREADS; s<<=1) {
+			unsigned int v = (threadIdx.x >= s) ? flags[threadIdx.x - s] : 0;
+			__syncthreads();
+			flags[threadIdx.x] += v;
+			__syncthreads();
+		}
+		if (flag) {
+			unsigned int pos = base + flags[threadIdx.x] - 1;
+			hits[2*pos]   = blockIdx.x * w + x;
+			hits[2*pos+1] = code;
+		}
+		base += flags[COMPACT_THREADS - 1];
+		__syncthreads();
+	}
+}
+
+__host__ void gpu_scanner_compact(const unsigned short *devOut, 
+								  unsigned int         *devRowStart, 
+								  unsigned int         *devHits, 
+								  int                  w, 
+								  int                  h) {
+	cuda_krnl_row_counts  <<< h, COMPACT_THREADS >>> (devOut, devRowStart, w);
+	cuda_krnl_row_offsets <<< 1, COMPACT_THREADS >>> (devRowStart, h);
+	cuda_krnl_row_hits    <<< h, COMPACT_THREADS >>> (devOut, devRowStart, devHits, w);
+}
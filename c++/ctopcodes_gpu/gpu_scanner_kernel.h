@@ -1,4 +1,8 @@
 #ifndef GPU_SCANNER_KERNEL_H
 #define GPU_SCANNER_KERNEL_H
 void gpu_scanner_compute(const unsigned int *devInRunSum, unsigned short *devOut, int w, int h);
+/** Packs the non-zero entries of devOut into devHits as (pixel index, code) pairs
+	in pixel order. devRowStart (h+1 entries) gets the first hit of each row, and
+	devRowStart[h] the number of hits. */
+void gpu_scanner_compact(const unsigned short *devOut, unsigned int *devRowStart, unsigned int *devHits, int w, int h);
 #endif
@@ -0,0 +1,253 @@
+/*
+ * Tangible Object Placement Codes (TopCodes)
+ * Copyright (c) 2016 Michael S. Horn
+ * 
+ *           Michael S. Horn (michael-horn@northwestern.edu)
+ *           Northwestern University
+ *           2120 Campus Drive
+ *           Evanston, IL 60613
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (version 2) as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#import "BitPlane.h"
+#include <algorithm>
+#include <climits>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+static inline int lowestBit(uint64_t word) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(word);
+#else
+    int n = 0;
+    while (!(word & 1)) { word >>= 1; n++; }
+    return n;
+#endif
+}
+
+
+static inline int highestBit(uint64_t word) {
+#if defined(__GNUC__)
+    return 63 - __builtin_clzll(word);
+#else
+    int n = 63;
+    while (!(word >> 63)) { word <<= 1; n--; }
+    return n;
+#endif
+}
+
+
+/*
+ * Transposes a 64x64 bit matrix in place: bit c of word r moves to bit r
+ * of word c.  Swaps blocks of 32, then 16, ... then single bits.
+ */
+static void transpose64(uint64_t *a) {
+    uint64_t m = 0x00000000ffffffffULL;
+    for (int j = 32; j != 0; j >>= 1, m ^= m << j) {
+        for (int k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+            uint64_t t = ((a[k] >> j) ^ a[k | j]) & m;
+            a[k] ^= t << j;
+            a[k | j] ^= t;
+        }
+    }
+}
+
+
+BitPlane::BitPlane() {
+    _data = NULL;
+    _step = 0;
+    _width = _height = 0;
+    _words = _colWords = 0;
+}
+
+
+void BitPlane::reset(const cv::Mat &image) {
+    _data = image.data;
+    _step = image.step;
+    _width = image.cols;
+    _height = image.rows;
+    _words = (_width + 63) / 64;
+    _colWords = (_height + 63) / 64;
+    _rows.resize((size_t)_words * _height);
+    _packed.assign((size_t)_words * _height, 0);
+    _columns.resize((size_t)_words * 64 * _colWords);
+    _transposed.assign((size_t)_words * _colWords, 0);
+}
+
+
+/*
+ * Packs word w of row y from the image, 16 pixels at a time where the
+ * whole word is inside the image
+ */
+uint64_t BitPlane::pack(int y, int w) {
+    const uchar *p = _data + y * _step + (w << 6);
+    int n = std::min(64, _width - (w << 6));
+    uint64_t bits = 0;
+    int i = 0;
+#if defined(__SSE2__)
+    if (n == 64) {
+        const __m128i white = _mm_set1_epi8((char)0xff);
+        for (; i < 64; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+            uint64_t m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, white));
+            bits |= m << i;
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        bits |= (uint64_t)(p[i] == 255) << i;
+    }
+    size_t k = (size_t)y * _words + w;
+    _rows[k] = bits;
+    _packed[k] = 1;
+    return bits;
+}
+
+
+void BitPlane::transpose(int bx, int by) {
+    uint64_t block[64];
+    for (int r = 0; r < 64; r++) {
+        int y = (by << 6) + r;
+        if (y >= _height) {
+            block[r] = 0;
+        } else {
+            size_t k = (size_t)y * _words + bx;
+            block[r] = _packed[k] ? _rows[k] : pack(y, bx);
+        }
+    }
+    transpose64(block);
+    for (int c = 0; c < 64; c++) {
+        _columns[(size_t)((bx << 6) + c) * _colWords + by] = block[c];
+    }
+    _transposed[by * _words + bx] = 1;
+}
+
+
+inline uint64_t BitPlane::word(int line, int vertical, int w) {
+    if (vertical) {
+        if (!_transposed[w * _words + (line >> 6)]) transpose(line >> 6, w);
+        return _columns[(size_t)line * _colWords + w];
+    } else {
+        size_t k = (size_t)line * _words + w;
+        return _packed[k] ? _rows[k] : pack(line, w);
+    }
+}
+
+
+/*
+ * First index in [from, to) of the row or column whose bit is set to
+ * value, or to
+ */
+int BitPlane::nextBit(int line, int vertical, int from, int to, int value) {
+    if (from >= to) return to;
+    const uint64_t flip = value ? 0 : ~(uint64_t)0;
+    int w = from >> 6;
+    uint64_t bits = (word(line, vertical, w) ^ flip) & (~(uint64_t)0 << (from & 63));
+    while (!bits) {
+        if (++w << 6 >= to) return to;
+        bits = word(line, vertical, w) ^ flip;
+    }
+    return std::min(to, (w << 6) + lowestBit(bits));
+}
+
+
+/*
+ * Last index in (to, from] of the row or column whose bit is set to
+ * value, or to
+ */
+int BitPlane::prevBit(int line, int vertical, int from, int to, int value) {
+    if (from <= to) return to;
+    const uint64_t flip = value ? 0 : ~(uint64_t)0;
+    int w = from >> 6;
+    uint64_t bits = (word(line, vertical, w) ^ flip) & (~(uint64_t)0 >> (63 - (from & 63)));
+    while (!bits) {
+        if (--w < 0 || (w << 6) + 63 <= to) return to;
+        bits = word(line, vertical, w) ^ flip;
+    }
+    return std::max(to, (w << 6) + highestBit(bits));
+}
+
+
+int BitPlane::dist(int x, int y, int dx, int dy) {
+    // steps until the walk would reach the edge, as in dist()
+    int limit = INT_MAX;
+    if (dx > 0) limit = _width - x;
+    else if (dx < 0) limit = std::max(x, 1);
+    else if (x <= 0 || x >= _width) limit = 1;
+    if (dy > 0) limit = std::min(limit, _height - y);
+    else if (dy < 0) limit = std::min(limit, std::max(y, 1));
+    else if (y <= 0 || y >= _height) limit = 1;
+
+    int vertical = (dx == 0);
+    int line = vertical ? x : y;
+    int pos  = vertical ? y : x;
+    int dir  = vertical ? dy : dx;
+    int start = (int)((word(line, vertical, pos >> 6) >> (pos & 63)) & 1);
+
+    if (dir > 0) {
+        int end = pos + limit;
+        int p = nextBit(line, vertical, pos + 1, end, !start);
+        if (p >= end) return limit;
+        return nextBit(line, vertical, p + 1, end, start) - pos;
+    } else {
+        int end = pos - limit;
+        int p = prevBit(line, vertical, pos - 1, end, !start);
+        if (p <= end) return limit;
+        return pos - prevBit(line, vertical, p - 1, end, start);
+    }
+}
+
+
+/*
+ * The run ends at the first pixel of the other colour that is followed
+ * (in the direction of the walk) by another one or by the edge.  Pixels
+ * past the edge count as the other colour, so a run that reaches the
+ * edge ends there.  Runs of limit or more pixels give limit.
+ */
+int BitPlane::columnRun(int x, int y, int dy, int white, int limit) {
+    if (y < 0 || y >= _height) return 0;
+    const uint64_t flip = white ? ~(uint64_t)0 : 0;
+    const int last = _colWords - 1;
+    const int tail = _height & 63;
+    const uint64_t past = tail ? ~(uint64_t)0 << tail : 0;
+
+    int w = y >> 6;
+    uint64_t other = (word(x, 1, w) ^ flip) | ((w == last) ? past : 0);
+    if (dy > 0) {
+        uint64_t keep = ~(uint64_t)0 << (y & 63);
+        while (true) {
+            uint64_t next = (w < last) ? (word(x, 1, w + 1) ^ flip) | ((w + 1 == last) ? past : 0)
+                                       : ~(uint64_t)0;
+            uint64_t ends = other & ((other >> 1) | (next << 63)) & keep;
+            if (ends) return std::min(limit, (w << 6) + lowestBit(ends) - y);
+            if (++w > last) return std::min(limit, _height - y);
+            if ((w << 6) - y >= limit) return limit;
+            other = next;
+            keep = ~(uint64_t)0;
+        }
+    } else {
+        uint64_t keep = ~(uint64_t)0 >> (63 - (y & 63));
+        while (true) {
+            uint64_t prev = (w > 0) ? word(x, 1, w - 1) ^ flip : ~(uint64_t)0;
+            uint64_t ends = other & ((other << 1) | (prev >> 63)) & keep;
+            if (ends) return std::min(limit, y - ((w << 6) + highestBit(ends)));
+            if (--w < 0) return std::min(limit, y + 1);
+            if (y - (w << 6) - 63 >= limit) return limit;
+            other = prev;
+            keep = ~(uint64_t)0;
+        }
+    }
+}
@@ -0,0 +1,94 @@
+/*
+ * Tangible Object Placement Codes (TopCodes)
+ * Copyright (c) 2016 Michael S. Horn
+ * 
+ *           Michael S. Horn (michael-horn@northwestern.edu)
+ *           Northwestern University
+ *           2120 Campus Drive
+ *           Evanston, IL 60613
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (version 2) as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#import <opencv2/highgui/highgui.hpp>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <climits>
+
+/*
+ * Bit-packed view of a binarized image, one bit per pixel (1 for white),
+ * for finding colour changes along rows and columns a word at a time.
+ * Nothing is packed up front: row words are packed from the image the
+ * first time a query reaches them, and column words are transposed from
+ * the rows 64x64 pixels at a time, so the cost follows the area the
+ * queries cover and neighboring queries share the work.
+ */
+class BitPlane {
+
+public:
+
+  BitPlane();
+
+/*
+ * Starts over on a binarized image (255 white), which must not change
+ * while the plane is in use
+ */
+  void reset(const cv::Mat &image);
+
+/*
+ * Number of pixels from (x, y) along a row (dy = 0) or a column (dx = 0)
+ * until the second colour change or the edge of the image.  The same
+ * result as the dist() pixel walk of TopCode.cpp.
+ */
+  int dist(int x, int y, int dx, int dy);
+
+/*
+ * Length of the run of white (or black) pixels in column x starting at
+ * row y and moving by dy.  A single stray pixel of the other colour does
+ * not end the run.  Stops counting at limit.
+ */
+  int columnRun(int x, int y, int dy, int white, int limit = INT_MAX);
+
+private:
+
+  const uchar *_data;
+  size_t _step;
+  int _width, _height;
+
+  /* Words per row, and per column */
+  int _words, _colWords;
+
+  /* Row words, with pixel x in bit x % 64 of word x / 64, and which of
+     them have been packed */
+  std::vector<uint64_t> _rows;
+  std::vector<unsigned char> _packed;
+
+  /* Column words, with pixel y in bit y % 64 of word y / 64, and which
+     64x64 blocks have been transposed into them */
+  std::vector<uint64_t> _columns;
+  std::vector<unsigned char> _transposed;
+
+  uint64_t pack(int y, int w);
+
+  void transpose(int bx, int by);
+
+  /* Word w of row (or column) line, packing or transposing it first if
+     need be */
+  uint64_t word(int line, int vertical, int w);
+
+  int nextBit(int line, int vertical, int from, int to, int value);
+
+  int prevBit(int line, int vertical, int from, int to, int value);
+
+};
@@ -0,0 +1,165 @@
+/*
+ * Tangible Object Placement Codes (TopCodes)
+ * Copyright (c) 2016 Michael S. Horn
+ * 
+ *           Michael S. Horn (michael-horn@northwestern.edu)
+ *           Northwestern University
+ *           2120 Campus Drive
+ *           Evanston, IL 60613
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (version 2) as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#import "FramePool.h"
+#include <stdlib.h>
+#include <new>
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#endif
+
+using namespace cv;
+
+
+/* Alignment of each buffer and of each row within it */
+const size_t LINE = 64;
+
+/* Size of a huge page, which the block is rounded up to */
+const size_t HUGE_PAGE = 2 << 20;
+
+
+static inline size_t align(size_t n, size_t to) {
+    return (n + to - 1) / to * to;
+}
+
+
+FramePool::FramePool(int count, int hugePages) {
+    _frames.resize(count);
+    _next = 0;
+    _hugePages = hugePages;
+    _huge = 0;
+    _block = NULL;
+    _length = 0;
+    _rows = 0;
+    _cols = 0;
+    _type = -1;
+}
+
+
+FramePool::~FramePool() {
+    release();
+}
+
+
+void FramePool::release() {
+    for (int i=0; i<_frames.size(); i++) {
+        _frames[i].capture.release();
+        _frames[i].mirror.release();
+        _frames[i].grey.release();
+    }
+    if (_block != NULL) {
+#if defined(MAP_HUGETLB)
+        if (_huge) {
+            munmap(_block, _length);
+        } else {
+            free(_block);
+        }
+#else
+        free(_block);
+#endif
+    }
+    _block = NULL;
+    _length = 0;
+    _huge = 0;
+}
+
+
+int FramePool::reserve(int rows, int cols, int type) {
+    if (_block != NULL && rows == _rows && cols == _cols && type == _type) {
+        return 0;
+    }
+    release();
+    _rows = rows;
+    _cols = cols;
+    _type = type;
+
+    size_t colourStep = align((size_t)cols * CV_ELEM_SIZE(type), LINE);
+    size_t greyStep = align((size_t)cols, LINE);
+    size_t frameSize = (2 * colourStep + greyStep) * rows;
+    size_t length = frameSize * _frames.size();
+    void *block = NULL;
+
+    if (_hugePages) {
+        length = align(length, HUGE_PAGE);
+#if defined(MAP_HUGETLB)
+        // explicit huge pages if some are reserved, otherwise ask for
+        // transparent ones below
+        block = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (block == MAP_FAILED) {
+            block = NULL;
+        } else {
+            _huge = 1;
+        }
+#endif
+    }
+    if (block == NULL) {
+        if (posix_memalign(&block, _hugePages ? HUGE_PAGE : LINE, length) != 0) {
+            block = NULL;
+        }
+#if defined(MADV_HUGEPAGE)
+        if (block != NULL && _hugePages) {
+            madvise(block, length, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    if (block == NULL) {
+        _rows = _cols = 0;
+        _type = -1;
+        throw std::bad_alloc();
+    }
+    _block = (unsigned char *)block;
+    _length = length;
+
+    unsigned char *p = _block;
+    for (int i=0; i<_frames.size(); i++) {
+        Frame &f = _frames[i];
+        f.capture = Mat(rows, cols, type, p, colourStep);
+        p += colourStep * rows;
+        f.mirror = Mat(rows, cols, type, p, colourStep);
+        p += colourStep * rows;
+        f.grey = Mat(rows, cols, CV_8UC1, p, greyStep);
+        p += greyStep * rows;
+    }
+    _next = 0;
+    return 1;
+}
+
+
+FramePool::Frame &FramePool::next() {
+    Frame &f = _frames[_next];
+    _next = (_next + 1) % _frames.size();
+    return f;
+}
+
+
+static inline int within(const Mat &m, const unsigned char *block, size_t length) {
+    return m.data >= block && m.data < block + length;
+}
+
+
+int FramePool::owns(Frame &frame) {
+    return (_block != NULL &&
+            within(frame.capture, _block, _length) &&
+            within(frame.mirror, _block, _length) &&
+            within(frame.grey, _block, _length));
+}
@@ -0,0 +1,93 @@
+/*
+ * Tangible Object Placement Codes (TopCodes)
+ * Copyright (c) 2016 Michael S. Horn
+ * 
+ *           Michael S. Horn (michael-horn@northwestern.edu)
+ *           Northwestern University
+ *           2120 Campus Drive
+ *           Evanston, IL 60613
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (version 2) as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#import <opencv2/highgui/highgui.hpp>
+#include <vector>
+#include <stddef.h>
+
+/*
+ * A fixed set of frame buffers for the capture loop, allocated once when
+ * the frame size is known and handed out in turn.  Each frame holds the
+ * image read from the camera, its mirror image and the greyscale copy
+ * that is scanned.  The buffers are aligned to cache lines, with rows
+ * padded to a multiple of the line size, and can be backed by huge pages
+ * where the system has them.  Because the matrices wrap memory of the
+ * right size and type, OpenCV writes into them in place instead of
+ * reallocating.
+ */
+class FramePool {
+
+public:
+
+  struct Frame {
+    cv::Mat capture;
+    cv::Mat mirror;
+    cv::Mat grey;
+  };
+
+/*
+ * A pool of count frames, backed by huge pages if hugePages is set and
+ * the system allows it
+ */
+  FramePool(int count, int hugePages = 0);
+
+  ~FramePool();
+
+/*
+ * (Re)allocates every frame for images of rows x cols of the given
+ * camera type, unless they already have that size and type.  Returns 1
+ * if the buffers were allocated.
+ */
+  int reserve(int rows, int cols, int type);
+
+/*
+ * The next frame in turn.  A frame comes round again after count calls.
+ */
+  Frame &next();
+
+/*
+ * 1 if the matrices of frame still wrap the pool's own buffers, 0 if
+ * something has reallocated one of them
+ */
+  int owns(Frame &frame);
+
+  int getCount() { return (int)_frames.size(); }
+
+  int usesHugePages() { return _huge; }
+
+private:
+
+  std::vector<Frame> _frames;
+
+  int _next;
+
+  int _hugePages, _huge;
+
+  /* One block for all the frames, and its length */
+  unsigned char *_block;
+  size_t _length;
+
+  int _rows, _cols, _type;
+
+  void release();
+
+};
@@ -0,0 +1,71 @@
+/*
+ * Tangible Object Placement Codes (TopCodes)
+ * Copyright (c) 2016 Michael S. Horn
+ * 
+ *           Michael S. Horn (michael-horn@northwestern.edu)
+ *           Northwestern University
+ *           2120 Campus Drive
+ *           Evanston, IL 60613
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (version 2) as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#import "Snapshot.h"
+
+
+/* Flag in _middle for a frame that has not been taken */
+const int FRESH = 4;
+
+
+/*
+ * Stores value in *slot and returns the previous value.  Release and
+ * acquire order it with the frames written before and read after, on
+ * either thread.
+ */
+static inline int exchange(int *slot, int value) {
+    return __atomic_exchange_n(slot, value, __ATOMIC_ACQ_REL);
+}
+
+
+Snapshot::Snapshot() {
+    _back = 0;
+    _middle = 1;
+    _front = 2;
+    for (int i=0; i<3; i++) {
+        _frames[i].number = -1;
+    }
+}
+
+
+int Snapshot::wanted() {
+    return !(__atomic_load_n(&_middle, __ATOMIC_ACQUIRE) & FRESH);
+}
+
+
+void Snapshot::publish(const cv::Mat &image, const std::vector<TopCode *> &codes, long number) {
+    Frame &f = _frames[_back];
+    image.copyTo(f.image);
+    f.codes.clear();
+    for (int i=0; i<codes.size(); i++) {
+        f.codes.push_back(*codes[i]);
+    }
+    f.number = number;
+    _back = exchange(&_middle, _back | FRESH) & ~FRESH;
+}
+
+
+Snapshot::Frame *Snapshot::take() {
+    if (!(__atomic_load_n(&_middle, __ATOMIC_ACQUIRE) & FRESH)) return NULL;
+    _front = exchange(&_middle, _front) & ~FRESH;
+    return &_frames[_front];
+}
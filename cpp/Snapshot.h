@@ -0,0 +1,77 @@
+/*
+ * Tangible Object Placement Codes (TopCodes)
+ * Copyright (c) 2016 Michael S. Horn
+ * 
+ *           Michael S. Horn (michael-horn@northwestern.edu)
+ *           Northwestern University
+ *           2120 Campus Drive
+ *           Evanston, IL 60613
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (version 2) as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#import <opencv2/highgui/highgui.hpp>
+#import "TopCode.h"
+#include <vector>
+
+/*
+ * Passes the latest frame and its codes from the capture loop to a
+ * reader on another thread without locks.  There are three slots: the
+ * writer fills one, the reader holds one, and the third is the latest
+ * published frame.  Publishing or taking a frame swaps a slot with the
+ * latest one in a single atomic exchange, so neither side ever waits for
+ * the other.  Frames the reader has not taken when the next one is
+ * published are dropped.  One writer thread and one reader thread.
+ */
+class Snapshot {
+
+public:
+
+  struct Frame {
+    cv::Mat image;
+    std::vector<TopCode> codes;
+    long number;
+  };
+
+  Snapshot();
+
+/*
+ * 1 if the reader has taken the last published frame (or none has been
+ * published yet), so that filling a new one is not wasted work
+ */
+  int wanted();
+
+/*
+ * Copies image and codes into the writer's slot and publishes it.  The
+ * slots keep their buffers, so this does not allocate once they have
+ * grown to the frame size and number of codes.
+ */
+  void publish(const cv::Mat &image, const std::vector<TopCode *> &codes, long number);
+
+/*
+ * The latest published frame if there is one the reader has not taken,
+ * otherwise NULL.  The frame stays the reader's until the next call.
+ */
+  Frame *take();
+
+private:
+
+  Frame _frames[3];
+
+  /* Slots held by the writer and the reader */
+  int _back, _front;
+
+  /* Slot of the latest published frame, with FRESH set until it is taken */
+  int _middle;
+
+};
@@ -21,8 +21,18 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 #import "TopCode.h"
+#import "BitPlane.h"
 #include <opencv2/imgproc.hpp> 
 #include <iostream>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <climits>
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define TOPCODE_AVX2 __attribute__((target("avx2")))
+#endif
 
 int dist(cv::Mat &image, int x, int y, int dx, int dy);
 int getSample3x3(cv::Mat &image, int x, int y);
@@ -37,6 +47,125 @@ const int WIDTH = 8;
 /* Span of a data sector in radians */
 const double ARC = (2.0 * M_PI / 13.0);
 
+/* Number of arc adjustments tried per sector */
+const int ARCS = 10;
+
+/* Relative unit adjustments, tried in order until a confident reading */
+const int UNITS = 5;
+const double UNIT_STEPS[UNITS] = { 0.0, -0.1, 0.1, -0.2, 0.2 };
+
+/* Score above which a coarse reading is accepted without refinement
+   (97% of a perfect 13 sector reading) */
+const int CONFIDENT = (int)(SECTORS * 7 * 0xff * 0.97);
+
+/* Share of the previous frame's score that a reading of the same code
+   at its unit and orientation needs to be taken without a full decode */
+const double TRACKED_SCORE = 0.95;
+
+/* Sample positions in readCode are computed in Q16.16 fixed point */
+const int FIX_SHIFT = 16;
+const double FIX_ONE = (double)(1 << FIX_SHIFT);
+
+
+/*
+ * Sector directions in fixed point for every arc adjustment tried by
+ * sweepArcs (-1 to ARCS steps of ARC / ARCS, stored at index step + 1),
+ * so readCode needs no trig or float conversions per sample
+ */
+struct Directions {
+    int dx[ARCS + 2][SECTORS];
+    int dy[ARCS + 2][SECTORS];
+
+    Directions() {
+        for (int a = -1; a <= ARCS; a++) {
+            for (int sector = 0; sector < SECTORS; sector++) {
+                double angle = ARC * sector + a * ARC / ARCS;
+                dx[a + 1][sector] = (int)floor(cos(angle) * FIX_ONE + 0.5);
+                dy[a + 1][sector] = (int)floor(sin(angle) * FIX_ONE + 0.5);
+            }
+        }
+    }
+};
+
+static const Directions DIRECTIONS;
+
+
+/*
+ * Classification of every 13 bit data ring reading: the lowest rotation
+ * of the bits (-1 unless exactly 5 bits are set), the number of left
+ * rotations that reach it, and its dense 0..98 id in ascending code order
+ * (-1 if not a TopCode).  c++/ctopcodes/topcode.cpp has its own copy, as
+ * that tree is built separately (Visual Studio, C++98); keep them in sync.
+ */
+struct CodeTable {
+    short canonical[1 << SECTORS];
+    unsigned char rotation[1 << SECTORS];
+    signed char id[1 << SECTORS];
+
+    CodeTable() {
+        const int mask = (1 << SECTORS) - 1;
+        int next = 0;
+        for (int bits = 0; bits <= mask; bits++) {
+            int ones = 0;
+            for (int i = 0; i < SECTORS; i++) {
+                ones += (bits >> i) & 1;
+            }
+            canonical[bits] = -1;
+            rotation[bits] = 0;
+            id[bits] = -1;
+            if (ones != 5) continue;
+
+            int min = bits;
+            int b = bits;
+            for (int i = 1; i < SECTORS; i++) {
+                b = ((b << 1) & mask) | (b >> (SECTORS - 1));
+                if (b < min) {
+                    min = b;
+                    rotation[bits] = i;
+                }
+            }
+            // the lowest rotation is never above bits, so it already has
+            // its id unless it is bits itself
+            canonical[bits] = min;
+            id[bits] = (min == bits) ? next++ : id[min];
+        }
+    }
+};
+
+static const CodeTable CODE_TABLE;
+
+
+CodeSet::CodeSet() {
+    clear();
+}
+
+
+void CodeSet::clear() {
+    memset(_readings, 0, sizeof(_readings));
+    _count = 0;
+}
+
+
+int CodeSet::contains(int code) {
+    return (code > 0 && code <= 0x1fff && CODE_TABLE.canonical[code] == code &&
+            _readings[code]);
+}
+
+
+void CodeSet::add(int code) {
+    if (code <= 0 || code > 0x1fff || CODE_TABLE.canonical[code] != code) return;
+    if (contains(code)) return;
+
+    // the data ring can be read starting from any sector
+    const int mask = (1 << SECTORS) - 1;
+    int b = code;
+    for (int i = 0; i < SECTORS; i++) {
+        _readings[b] = 1;
+        b = ((b << 1) & mask) | (b >> (SECTORS - 1));
+    }
+    _count++;
+}
+
 
 TopCode::TopCode() {
   code = -1;
@@ -44,6 +173,7 @@ TopCode::TopCode() {
   orientation = 0.0;
   x = 0.0;
   y = 0.0;
+  _score = 0;
 }
 
 
@@ -53,6 +183,7 @@ TopCode::TopCode(double cx, double cy) {
   orientation = 0.0;
   x = cx;
   y = cy;
+  _score = 0;
 }
 
 
@@ -62,6 +193,7 @@ TopCode::TopCode(TopCode * other) {
     orientation = other->orientation;
     x = other->x;
     y = other->y;
+    _score = other->_score;
 }
 
 
@@ -75,6 +207,11 @@ double TopCode::getRadius() {
 }
 
 
+int TopCode::getIndex() {
+  return (code > 0) ? CODE_TABLE.id[code & 0x1fff] : -1;
+}
+
+
 int TopCode::contains(double tx, double ty) {
   double d = (x - tx) * (x - tx) + (y - ty) * (y - ty);
   double r = unit * WIDTH * 0.5;
@@ -92,76 +229,292 @@ void TopCode::draw(cv::Mat &image) {
  * will be a positive integer and the center, unit, and orientation
  * properties will be set. If unsuccessful, code will be -1.
  */
-int TopCode::decode(cv::Mat &image) {
-    int cx    = (int)x;
-    int cy    = (int)y;
-    int up    = dist(image, cx, cy, 0, -1);
-    int down  = dist(image, cx, cy, 0, 1);
-    int left  = dist(image, cx, cy, -1, 0);
-    int right = dist(image, cx, cy, 1, 0);
-    
-    x += (right - left) / 2.0;
-    y += (down - up) / 2.0;
-    unit = (right + left + up + down) / 8.0;
-    code = -1;
+int TopCode::decode(cv::Mat &image, int guard, BitPlane *plane,
+                    const CodeSet *expected) {
+    locate(image, plane);
     
-    int score = 0;
+    int checked = !inGuard(image, guard);
+    int score;
     int maxs = 0;      // maximum confidence score so far
     int maxc = -1;     // maximum code so far
     double maxa = 0.0; // maximum arc adjustment so far
+    double maxu = unit;
+    double base = unit;
     double arca;
-    
-    for (int a = 0; a < 5; a++) {
-        arca = a * ARC / 5.0;
-        score = readCode(image, arca);
+
+    //-----------------------------------------
+    // Sweep the arc adjustments at the measured
+    // unit, and only if that gives no confident
+    // reading at slightly smaller / larger units
+    //-----------------------------------------
+    for (int u = 0; u < UNITS && maxs < CONFIDENT; u++) {
+        unit = base + base * UNIT_STEPS[u];
+        score = sweepArcs(image, arca, checked);
         if (score > maxs) {
             maxs = score;
             maxc = code;
             maxa = arca;
+            maxu = unit;
         }
     }
-    
-    if (maxs > 0) {
-        code = rotateLowest(maxc, arca);
+
+    // the best reading decides: if it is some other code than the ones
+    // expected, there is no code here, rather than a weaker reading that
+    // happens to be an expected one
+    unit = maxu;
+    code = -1;
+    _score = 0;
+    if (maxs > 0 && (!expected || expected->matches(maxc))) {
+        code = rotateLowest(maxc, maxa);
+        _score = maxs;
     }
     return code;
 }
 
 
-int TopCode::readCode(cv::Mat &image, double arca) {
-    double dx, dy;
-    double dist;
+int TopCode::decodeFrom(cv::Mat &image, const TopCode &previous, int guard,
+                        BitPlane *plane, const CodeSet *expected) {
+    double cx = x, cy = y, u = unit;
+    locate(image, plane);
+    unit = previous.unit;
+    int checked = !inGuard(image, guard);
+
+    // the arc adjustment that rotateLowest turns into the previous
+    // orientation, whichever sector the reading starts at
+    double arca = fmod(previous.orientation + ARC * 0.5, ARC);
+    if (arca < 0) arca += ARC;
+    int arc = (int)(arca * ARCS / ARC + 0.5) % ARCS;
+
+    // a clearly weaker reading of the same code can come from a misaligned
+    // orientation, so it has to come close to the previous one (or be
+    // confident, which is where the sweeps stop anyway)
+    int score = readCode(image, arc, checked);
+    int enough = std::min(CONFIDENT, (int)(previous._score * TRACKED_SCORE));
+    if (score > 0 && score >= enough && CODE_TABLE.canonical[code] == previous.code &&
+        (!expected || expected->matches(code))) {
+        code = rotateLowest(code, arc * ARC / ARCS);
+        _score = score;
+        return code;
+    }
+    x = cx;
+    y = cy;
+    unit = u;
+    code = -1;
+    return 0;
+}
+
+
+/*
+ * Pixels out of the 17 taken by probe that may disagree with a bulls-eye,
+ * and the scales of the unit estimate tried.  Seed units come from a
+ * vertical run that noise in the black ring can cut short, so a larger
+ * unit is tried before giving up.
+ */
+const int PROBE_MISSES = 3;
+const int PROBE_SCALES = 2;
+const double PROBE_SCALE[PROBE_SCALES] = { 1.0, 1.4 };
+
+
+/*
+ * Counts the probe pixels at unit u around (x, y) that disagree with a
+ * bulls-eye, stopping once there are more than PROBE_MISSES.  Pixels off
+ * the image count as matches, as decode would still try the candidate.
+ */
+static int probeMisses(cv::Mat &image, double x, double y, double u) {
+    static const double DX[8] = { 1, 0.7071, 0, -0.7071, -1, -0.7071, 0, 0.7071 };
+    static const double DY[8] = { 0, 0.7071, 1, 0.7071, 0, -0.7071, -1, -0.7071 };
+    int misses = 0;
+    int px, py;
+
+    for (int ring = 0; ring < 3; ring++) {
+        double r = (ring == 0) ? 0 : u * (ring + 0.5);
+        int white = (ring != 1);
+        for (int d = 0; d < ((ring == 0) ? 1 : 8); d++) {
+            px = (int)floor(x + DX[d] * r + 0.5);
+            py = (int)floor(y + DY[d] * r + 0.5);
+            if (px < 0 || py < 0 || px >= image.cols || py >= image.rows) continue;
+            if ((image.at<uchar>(py, px) == 255) != white) {
+                if (++misses > PROBE_MISSES) return misses;
+            }
+        }
+    }
+    return misses;
+}
+
+
+int TopCode::probe(cv::Mat &image) {
+    for (int s = 0; s < PROBE_SCALES; s++) {
+        if (probeMisses(image, x, y, unit * PROBE_SCALE[s]) <= PROBE_MISSES) return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Centers the candidate on the bulls-eye and measures the unit from the
+ * distances to the outer edges of the black ring
+ */
+void TopCode::locate(cv::Mat &image, BitPlane *plane) {
+    int cx    = (int)x;
+    int cy    = (int)y;
+    int up, down, left, right;
+    if (plane) {
+        up    = plane->dist(cx, cy, 0, -1);
+        down  = plane->dist(cx, cy, 0, 1);
+        left  = plane->dist(cx, cy, -1, 0);
+        right = plane->dist(cx, cy, 1, 0);
+    } else {
+        up    = dist(image, cx, cy, 0, -1);
+        down  = dist(image, cx, cy, 0, 1);
+        left  = dist(image, cx, cy, -1, 0);
+        right = dist(image, cx, cy, 1, 0);
+    }
+    
+    x += (right - left) / 2.0;
+    y += (down - up) / 2.0;
+    unit = (right + left + up + down) / 8.0;
+    code = -1;
+}
+
+
+/*
+ * Whether every pixel readCode could read for this candidate, at any of
+ * the UNIT_STEPS, lies within guard pixels of the image.  Samples reach
+ * three and a half units from the center; the slack covers rounding, the
+ * 3x3 region and the 4 byte gathers of sampleLanes.
+ */
+int TopCode::inGuard(cv::Mat &image, int guard) {
+    if (guard <= 0) return 0;
+    double step = 0;
+    for (int u = 0; u < UNITS; u++) step = std::max(step, UNIT_STEPS[u]);
+    double reach = 3.5 * unit * (1 + step) + 3;
+    return (x - reach >= -guard && x + reach < image.cols + guard &&
+            y - reach >= -guard && y + reach < image.rows + guard);
+}
+
+
+/*
+ * Coarse-to-fine search for the arc adjustment that gives the best reading
+ * at the current unit.  Every other arc offset is tried first, stopping at
+ * the first confident reading; otherwise the two offsets on either side of
+ * the best coarse reading are tried as well.  Returns the best score (0 if
+ * nothing decoded) and leaves the matching bits in code.
+ */
+int TopCode::sweepArcs(cv::Mat &image, double &maxa, int checked) {
+    int score;
+    int maxs = 0;
+    int maxc = -1;
+    int best = 0;
+
+    for (int a = 0; a < ARCS && maxs < CONFIDENT; a += 2) {
+        score = readCode(image, a, checked);
+        if (score > maxs) {
+            maxs = score;
+            maxc = code;
+            best = a;
+        }
+    }
+
+    // refine around the best coarse reading
+    if (maxs > 0 && maxs < CONFIDENT) {
+        int center = best;
+        for (int a = center - 1; a <= center + 1; a += 2) {
+            score = readCode(image, a, checked);
+            if (score > maxs) {
+                maxs = score;
+                maxc = code;
+                best = a;
+            }
+        }
+    }
+
+    code = maxc;
+    maxa = best * ARC / ARCS;
+    return maxs;
+}
+
+
+/*
+ * getSample3x3 without the bounds check, for positions known to be at
+ * least one pixel inside the buffer image is a view into
+ */
+static inline int sample3x3(cv::Mat &image, int x, int y) {
+    const int step = (int)image.step;
+    const uchar *p = image.data + (y - 1) * step + (x - 1);
+    int sum = (p[0] == 255) + (p[1] == 255) + (p[2] == 255);
+    p += step;
+    sum += (p[0] == 255) + (p[1] == 255) + (p[2] == 255);
+    p += step;
+    sum += (p[0] == 255) + (p[1] == 255) + (p[2] == 255);
+    return (sum * 255) / 9;
+}
+
+
+/*
+ * Takes the i-th of the WIDTH samples across the symbol's diameter, where
+ * (sx, sy) is the position of sample 0 and (ux, uy) one unit along the
+ * sector direction, all in Q16.16
+ */
+static inline int sampleCore(cv::Mat &image, int sx, int sy,
+                             int ux, int uy, int i, int checked) {
+    int x = (sx + i * ux) >> FIX_SHIFT;
+    int y = (sy + i * uy) >> FIX_SHIFT;
+    return checked ? getSample3x3(image, x, y) : sample3x3(image, x, y);
+}
+
+
+/*
+ * Reads the data ring with the sectors turned by arc steps of ARC / ARCS
+ * (-1 to ARCS).  Returns a confidence score and sets code to the bits
+ * read, or returns 0 if the samples do not look like a TopCode.  Samples
+ * are only bounds checked if checked is set.
+ */
+int TopCode::readCode(cv::Mat &image, int arc, int checked) {
+    const int *dirx = DIRECTIONS.dx[arc + 1];
+    const int *diry = DIRECTIONS.dy[arc + 1];
+    const int fx = (int)(x * FIX_ONE);
+    const int fy = (int)(y * FIX_ONE);
+    const int64_t fu = (int64_t)(unit * FIX_ONE);
+    int ux, uy, sx, sy;
     int score = 0;
-    int sx, sy;
     int bit, bits = 0;
     int checksum = 0;
     int core[] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    const int wcut = 128 - 75;
+    const int bcut = 128 + 75;
     code = -1;
    
     for (int sector = 0; sector<SECTORS; sector++) {
-        dx = cos(ARC * sector + arca);
-        dy = sin(ARC * sector + arca);
+        // one unit along the sector direction, and sample 0 three
+        // and a half units back from the center
+        ux = (int)((dirx[sector] * fu) >> FIX_SHIFT);
+        uy = (int)((diry[sector] * fu) >> FIX_SHIFT);
+        sx = fx - ((7 * ux) >> 1);
+        sy = fy - ((7 * uy) >> 1);
       
-        // take a core sample at this orientation
-        for (int i=0; i<WIDTH; i++) {
-            dist = (i - 3.5) * unit;
-            sx = (int)(x + dx * dist);
-            sy = (int)(y + dy * dist);
-            core[i] = getSample3x3(image, sx, sy);
-        }
-
-        int cut = 128 - 75;
-      
-        // white rings
-        if (core[1] <= cut || core[3] <= cut || core[4] <= cut || core[6] <= cut) {
-           return 0;
-        }
-      
-        // black rings
-        cut = 128 + 75;
-        if (core[2] > cut || core[5] > cut) {
-           return 0;
-        }
+        //-----------------------------------------
+        // Take the core sample from the bulls-eye
+        // outwards and give up on the first ring
+        // that fails, before sampling the rest.
+        //-----------------------------------------
+
+        // white bulls-eye
+        core[3] = sampleCore(image, sx, sy, ux, uy, 3, checked);
+        core[4] = sampleCore(image, sx, sy, ux, uy, 4, checked);
+        if (core[3] <= wcut || core[4] <= wcut) return 0;
+
+        // black ring
+        core[2] = sampleCore(image, sx, sy, ux, uy, 2, checked);
+        core[5] = sampleCore(image, sx, sy, ux, uy, 5, checked);
+        if (core[2] > bcut || core[5] > bcut) return 0;
+
+        // white ring
+        core[1] = sampleCore(image, sx, sy, ux, uy, 1, checked);
+        core[6] = sampleCore(image, sx, sy, ux, uy, 6, checked);
+        if (core[1] <= wcut || core[6] <= wcut) return 0;
+
+        // data ring
+        core[7] = sampleCore(image, sx, sy, ux, uy, 7, checked);
 
         // compute running accuracy score for this configuration     
         score += core[1] + core[3] + core[4] + core[6];
@@ -171,6 +524,7 @@ int TopCode::readCode(cv::Mat &image, double arca) {
         // decode bits in outer ring
         bit = (core[7] > 128)? 1 : 0;
         checksum += bit;
+        if (checksum > 5) return 0;
         bits <<= 1;
         bits += bit;
     }
@@ -185,26 +539,300 @@ int TopCode::readCode(cv::Mat &image, double arca) {
 
 
 /*
- * Start with decoded bits and rotate the TopCode to find the orientation that 
+ * Candidates decoded together by decodeBatch, one per vector lane.  Each
+ * lane keeps its located center and measured unit, and the best reading
+ * over all unit and arc adjustments, as decode does.
+ */
+const int LANES = 8;
+
+struct Lanes {
+    double x[LANES], y[LANES], base[LANES];
+    int score[LANES];   // best score so far (0 if nothing decoded)
+    int bits[LANES];    // bits of the best reading
+    int arc[LANES];     // arc step of the best reading
+    double unit[LANES]; // unit of the best reading
+};
+
+
+#if defined(TOPCODE_AVX2)
+
+/*
+ * Low 32 bits of (a * b) >> FIX_SHIFT for each lane, with 64 bit products
+ */
+TOPCODE_AVX2
+static inline __m256i mulFixed(__m256i a, __m256i b) {
+    __m256i even = _mm256_srli_epi64(_mm256_mul_epi32(a, b), FIX_SHIFT);
+    __m256i odd  = _mm256_mul_epi32(_mm256_srli_epi64(a, 32), _mm256_srli_epi64(b, 32));
+    return _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32 - FIX_SHIFT), 0xaa);
+}
+
+
+/*
+ * Takes the i-th of the WIDTH samples across the symbol for every lane in
+ * mask, the same value getSample3x3 gives (0 outside the image).  Each row
+ * of the 3x3 region is one 32 bit gather; the bottom row of the very last
+ * sample position in the image is read a byte early so that the gather
+ * never reads past the end of the image.  Unless checked is set the lanes
+ * are all known to be inside the guard band and none of this is needed.
+ */
+TOPCODE_AVX2
+static inline __m256i sampleLanes(const cv::Mat &image, __m256i sx, __m256i sy,
+                                  __m256i ux, __m256i uy, int i, __m256i mask,
+                                  int checked) {
+    const int step = (int)image.step;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one  = _mm256_set1_epi32(1);
+    const __m256i n    = _mm256_set1_epi32(i);
+    const int *data    = (const int *)image.data;
+
+    __m256i px = _mm256_srai_epi32(_mm256_add_epi32(sx, _mm256_mullo_epi32(ux, n)), FIX_SHIFT);
+    __m256i py = _mm256_srai_epi32(_mm256_add_epi32(sy, _mm256_mullo_epi32(uy, n)), FIX_SHIFT);
+
+    __m256i corner = zero;
+    if (checked) {
+        // 1 <= px <= cols - 2 and 1 <= py <= rows - 2
+        mask = _mm256_and_si256(mask, _mm256_cmpgt_epi32(px, zero));
+        mask = _mm256_and_si256(mask, _mm256_cmpgt_epi32(py, zero));
+        mask = _mm256_and_si256(mask, _mm256_cmpgt_epi32(_mm256_set1_epi32(image.cols - 1), px));
+        mask = _mm256_and_si256(mask, _mm256_cmpgt_epi32(_mm256_set1_epi32(image.rows - 1), py));
+        corner = _mm256_and_si256(_mm256_cmpeq_epi32(px, _mm256_set1_epi32(image.cols - 2)),
+                                  _mm256_cmpeq_epi32(py, _mm256_set1_epi32(image.rows - 2)));
+    }
+
+    __m256i center = _mm256_add_epi32(_mm256_mullo_epi32(py, _mm256_set1_epi32(step)), px);
+    __m256i top = _mm256_sub_epi32(center, _mm256_set1_epi32(step + 1));
+    __m256i mid = _mm256_sub_epi32(center, one);
+    __m256i bot = _mm256_sub_epi32(_mm256_add_epi32(center, _mm256_set1_epi32(step - 1)),
+                                   _mm256_and_si256(corner, one));
+
+    __m256i r0 = _mm256_mask_i32gather_epi32(zero, data, top, mask, 1);
+    __m256i r1 = _mm256_mask_i32gather_epi32(zero, data, mid, mask, 1);
+    __m256i r2 = _mm256_mask_i32gather_epi32(zero, data, bot, mask, 1);
+    r2 = _mm256_srlv_epi32(r2, _mm256_and_si256(corner, _mm256_set1_epi32(8)));
+
+    // white pixels in the low three bytes of each row, summed byte-wise
+    // and then across the bytes with a multiply
+    const __m256i white = _mm256_set1_epi8((char)0xff);
+    const __m256i ones  = _mm256_set1_epi32(0x010101);
+    __m256i count = _mm256_and_si256(_mm256_cmpeq_epi8(r0, white), ones);
+    count = _mm256_add_epi32(count, _mm256_and_si256(_mm256_cmpeq_epi8(r1, white), ones));
+    count = _mm256_add_epi32(count, _mm256_and_si256(_mm256_cmpeq_epi8(r2, white), ones));
+    count = _mm256_srli_epi32(_mm256_mullo_epi32(count, ones), 16);
+    count = _mm256_and_si256(count, _mm256_set1_epi32(0xff));
+
+    // (count * 255) / 9, exact for counts 0 to 9
+    return _mm256_srli_epi32(_mm256_mullo_epi32(count, _mm256_set1_epi32(255 * 7282)), 16);
+}
+
+
+/*
+ * readCode for the lanes set in on, with each lane's center, unit (Q16.16)
+ * and arc step.  Stores each lane's score (0 if it did not decode) and
+ * bits.
+ */
+TOPCODE_AVX2
+static void readLanes(const cv::Mat &image, const int *fx, const int *fy,
+                      const int *fu, const int *arc, int on, int *score, int *bits,
+                      int checked) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i wcut = _mm256_set1_epi32(128 - 75);
+    const __m256i bcut = _mm256_set1_epi32(128 + 75);
+    const __m256i full = _mm256_set1_epi32(0xff);
+    const __m256i lane = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+
+    __m256i x = _mm256_loadu_si256((const __m256i *)fx);
+    __m256i y = _mm256_loadu_si256((const __m256i *)fy);
+    __m256i u = _mm256_loadu_si256((const __m256i *)fu);
+    __m256i index = _mm256_mullo_epi32(_mm256_add_epi32(_mm256_loadu_si256((const __m256i *)arc),
+                                                        _mm256_set1_epi32(1)),
+                                       _mm256_set1_epi32(SECTORS));
+    __m256i alive = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(on), lane), lane);
+    __m256i total = zero;
+    __m256i code = zero;
+    __m256i checksum = zero;
+
+    for (int sector = 0; sector < SECTORS; sector++) {
+        __m256i s  = _mm256_add_epi32(index, _mm256_set1_epi32(sector));
+        __m256i ux = mulFixed(_mm256_i32gather_epi32(&DIRECTIONS.dx[0][0], s, 4), u);
+        __m256i uy = mulFixed(_mm256_i32gather_epi32(&DIRECTIONS.dy[0][0], s, 4), u);
+        __m256i sx = _mm256_sub_epi32(x, _mm256_srai_epi32(_mm256_mullo_epi32(ux, _mm256_set1_epi32(7)), 1));
+        __m256i sy = _mm256_sub_epi32(y, _mm256_srai_epi32(_mm256_mullo_epi32(uy, _mm256_set1_epi32(7)), 1));
+
+        // white bulls-eye
+        __m256i c3 = sampleLanes(image, sx, sy, ux, uy, 3, alive, checked);
+        __m256i c4 = sampleLanes(image, sx, sy, ux, uy, 4, alive, checked);
+        alive = _mm256_and_si256(alive, _mm256_and_si256(_mm256_cmpgt_epi32(c3, wcut),
+                                                         _mm256_cmpgt_epi32(c4, wcut)));
+        if (_mm256_testz_si256(alive, alive)) break;
+
+        // black ring
+        __m256i c2 = sampleLanes(image, sx, sy, ux, uy, 2, alive, checked);
+        __m256i c5 = sampleLanes(image, sx, sy, ux, uy, 5, alive, checked);
+        alive = _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpgt_epi32(c2, bcut),
+                                                    _mm256_cmpgt_epi32(c5, bcut)), alive);
+        if (_mm256_testz_si256(alive, alive)) break;
+
+        // white ring
+        __m256i c1 = sampleLanes(image, sx, sy, ux, uy, 1, alive, checked);
+        __m256i c6 = sampleLanes(image, sx, sy, ux, uy, 6, alive, checked);
+        alive = _mm256_and_si256(alive, _mm256_and_si256(_mm256_cmpgt_epi32(c1, wcut),
+                                                         _mm256_cmpgt_epi32(c6, wcut)));
+        if (_mm256_testz_si256(alive, alive)) break;
+
+        // data ring
+        __m256i c7 = sampleLanes(image, sx, sy, ux, uy, 7, alive, checked);
+
+        total = _mm256_add_epi32(total, _mm256_add_epi32(_mm256_add_epi32(c1, c3), _mm256_add_epi32(c4, c6)));
+        total = _mm256_add_epi32(total, _mm256_add_epi32(_mm256_sub_epi32(full, c2), _mm256_sub_epi32(full, c5)));
+        total = _mm256_add_epi32(total, _mm256_abs_epi32(_mm256_sub_epi32(_mm256_add_epi32(c7, c7), full)));
+
+        __m256i bit = _mm256_srli_epi32(_mm256_cmpgt_epi32(c7, _mm256_set1_epi32(128)), 31);
+        checksum = _mm256_add_epi32(checksum, bit);
+        alive = _mm256_andnot_si256(_mm256_cmpgt_epi32(checksum, _mm256_set1_epi32(5)), alive);
+        code = _mm256_or_si256(_mm256_slli_epi32(code, 1), bit);
+    }
+
+    alive = _mm256_and_si256(alive, _mm256_cmpeq_epi32(checksum, _mm256_set1_epi32(5)));
+    _mm256_storeu_si256((__m256i *)score, _mm256_and_si256(total, alive));
+    _mm256_storeu_si256((__m256i *)bits, code);
+}
+
+
+/*
+ * The unit and arc search of decode, run for all lanes at once.  Lanes
+ * that have a confident reading drop out of the later passes, and the
+ * refinement around the best coarse arc uses each lane's own arc.
+ */
+TOPCODE_AVX2
+static void sweepLanes(const cv::Mat &image, Lanes &lanes, int checked) {
+    int fx[LANES], fy[LANES], fu[LANES], arc[LANES];
+    int score[LANES], bits[LANES];
+    int smax[LANES], sbits[LANES], sarc[LANES];
+    double unit[LANES];
+
+    for (int l = 0; l < LANES; l++) {
+        fx[l] = (int)(lanes.x[l] * FIX_ONE);
+        fy[l] = (int)(lanes.y[l] * FIX_ONE);
+    }
+
+    for (int u = 0; u < UNITS; u++) {
+        int active = 0;
+        for (int l = 0; l < LANES; l++) {
+            if (lanes.score[l] < CONFIDENT) active |= 1 << l;
+            unit[l] = lanes.base[l] + lanes.base[l] * UNIT_STEPS[u];
+            fu[l] = (int)(unit[l] * FIX_ONE);
+            smax[l] = 0;
+            sbits[l] = -1;
+            sarc[l] = 0;
+        }
+        if (!active) break;
+
+        // coarse pass over every other arc adjustment
+        for (int a = 0; a < ARCS; a += 2) {
+            int on = 0;
+            for (int l = 0; l < LANES; l++) {
+                if ((active & (1 << l)) && smax[l] < CONFIDENT) on |= 1 << l;
+                arc[l] = a;
+            }
+            if (!on) break;
+            readLanes(image, fx, fy, fu, arc, on, score, bits, checked);
+            for (int l = 0; l < LANES; l++) {
+                if (score[l] > smax[l]) {
+                    smax[l] = score[l];
+                    sbits[l] = bits[l];
+                    sarc[l] = a;
+                }
+            }
+        }
+
+        // refine around each lane's best coarse reading
+        int on = 0;
+        int center[LANES];
+        for (int l = 0; l < LANES; l++) {
+            if ((active & (1 << l)) && smax[l] > 0 && smax[l] < CONFIDENT) on |= 1 << l;
+            center[l] = sarc[l];
+        }
+        for (int d = -1; on && d <= 1; d += 2) {
+            for (int l = 0; l < LANES; l++) arc[l] = center[l] + d;
+            readLanes(image, fx, fy, fu, arc, on, score, bits, checked);
+            for (int l = 0; l < LANES; l++) {
+                if ((on & (1 << l)) && score[l] > smax[l]) {
+                    smax[l] = score[l];
+                    sbits[l] = bits[l];
+                    sarc[l] = arc[l];
+                }
+            }
+        }
+
+        for (int l = 0; l < LANES; l++) {
+            if ((active & (1 << l)) && smax[l] > lanes.score[l]) {
+                lanes.score[l] = smax[l];
+                lanes.bits[l] = sbits[l];
+                lanes.arc[l] = sarc[l];
+                lanes.unit[l] = unit[l];
+            }
+        }
+    }
+}
+
+#endif
+
+
+void TopCode::decodeBatch(cv::Mat &image, TopCode **codes, int n, int guard,
+                          BitPlane *plane, const CodeSet *expected) {
+    int i = 0;
+
+#if defined(TOPCODE_AVX2)
+    if (__builtin_cpu_supports("avx2")) {
+        Lanes lanes;
+        for (; i + LANES <= n; i += LANES) {
+            int checked = 0;
+            for (int l = 0; l < LANES; l++) {
+                TopCode *top = codes[i + l];
+                top->locate(image, plane);
+                checked |= !top->inGuard(image, guard);
+                lanes.x[l] = top->x;
+                lanes.y[l] = top->y;
+                lanes.base[l] = top->unit;
+                lanes.unit[l] = top->unit;
+                lanes.score[l] = 0;
+                lanes.bits[l] = -1;
+                lanes.arc[l] = 0;
+            }
+
+            sweepLanes(image, lanes, checked);
+
+            for (int l = 0; l < LANES; l++) {
+                TopCode *top = codes[i + l];
+                top->unit = lanes.unit[l];
+                top->code = -1;
+                top->_score = 0;
+                if (lanes.score[l] > 0 && (!expected || expected->matches(lanes.bits[l]))) {
+                    top->code = top->rotateLowest(lanes.bits[l], lanes.arc[l] * ARC / ARCS);
+                    top->_score = lanes.score[l];
+                }
+            }
+        }
+    }
+#endif
+
+    // scalar tail
+    for (; i < n; i++) {
+        codes[i]->decode(image, guard, plane, expected);
+    }
+}
+
+
+/*
+ * Start with decoded bits and look up the rotation of the TopCode that
  * produces the lowest code.  Returns the lowest code and set the orientation 
  * property
  */
 int TopCode::rotateLowest(int bits, double arca) {
-    int min = bits;
-    int mask = 0x1fff;
-   
+    bits &= 0x1fff;
     arca -= (ARC * 0.5);
-    orientation = 0.0;
-   
-    for (int i=1; i<=SECTORS; i++) {
-        bits = (((bits << 1) & mask) | (bits >> (SECTORS - 1)));
-        if (bits < min) {
-            min = bits;
-            orientation = (i * -ARC);
-        }
-    }
-    orientation += arca;
-    return min;
+    orientation = (CODE_TABLE.rotation[bits] * -ARC) + arca;
+    return CODE_TABLE.canonical[bits];
 }
 
 
@@ -231,41 +859,53 @@ int getSample3x3(cv::Mat &image, int x, int y) {
 
 
 /*
- * Counts the number of pixels from (x, y) until a color change
+ * Counts the number of pixels from (x, y) until the second color change,
+ * or until the walk reaches the edge of the image.  The number of steps to
+ * the edge is worked out first so the walk itself needs no bounds checks.
  */
 int dist(cv::Mat &image, int x, int y, int dx, int dy) {
-    int p;
-    int dist = 0;
-    int start = (image.at<uchar>(y, x) == 255) ? 1 : 0;
+    int limit = INT_MAX;
+    if (dx > 0) limit = image.cols - x;
+    else if (dx < 0) limit = std::max(x, 1);
+    else if (x <= 0 || x >= image.cols) limit = 1;
+    if (dy > 0) limit = std::min(limit, image.rows - y);
+    else if (dy < 0) limit = std::min(limit, std::max(y, 1));
+    else if (y <= 0 || y >= image.rows) limit = 1;
+
+    const int step = dx + dy * (int)image.step;
+    const uchar *p = image.data + y * (int)image.step + x;
+    int start = (*p == 255) ? 1 : 0;
     bool changed = false;
-    
-    while (true) {
-        x += dx;
-        y += dy;
-        dist++;
-        if (x <= 0 || x >= image.cols || y <= 0 || y >= image.rows) {
-            return dist;
-        } else {
-            p = (image.at<uchar>(y, x) == 255) ? 1 : 0;
-            if (p != start) {
-                if (changed) {
-                    return dist;
-                } else {
-                    changed = true;
-                    start = p;
-                }
+
+    for (int dist = 1; dist < limit; dist++) {
+        p += step;
+        int q = (*p == 255) ? 1 : 0;
+        if (q != start) {
+            if (changed) {
+                return dist;
+            } else {
+                changed = true;
+                start = q;
             }
         }
     }
+    return limit;
 }
 
 
 std::string TopCode::toJSON() {
-    char json[256];
-    sprintf(json, 
+    std::string json;
+    appendJSON(json);
+    return json;
+}
+
+
+void TopCode::appendJSON(std::string &json) {
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
         "{ \"code\" : %d, \"x\" : %f, \"y\" : %f, \"unit\" : %f, \"angle\" : %f }",
         code, x, y, unit, orientation);
-    return std::string(json);
+    json += buffer;
 }
 
 
@@ -24,6 +24,41 @@
 #import <opencv2/highgui/highgui.hpp>
 #include <string>
 
+class BitPlane;
+
+
+/*
+ * A set of expected codes, kept as a flag for every 13 bit data ring
+ * reading that is one of their rotations, so that a reading is checked
+ * against the set with a single lookup
+ */
+class CodeSet {
+
+public:
+
+  CodeSet();
+
+  /* Adds a code; anything that is not a valid TopCode is ignored */
+  void add(int code);
+
+  void clear();
+
+  int isEmpty() { return _count == 0; }
+
+  int contains(int code);
+
+  /* Whether the bits of a data ring reading are one of the codes */
+  int matches(int bits) const { return _readings[bits & 0x1fff]; }
+
+private:
+
+  unsigned char _readings[1 << 13];
+
+  int _count;
+
+};
+
+
 class TopCode {
 
 public:
@@ -56,17 +91,70 @@ public:
 
   int isValid() { return code > 0; }
 
+  /* Dense index of the code from 0 to 98 in ascending code order, or -1 */
+  int getIndex();
+
   int contains(double tx, double ty);
 
   void draw(cv::Mat &image);
 
-  int decode(cv::Mat &image);
+/*
+ * If image is a view into a larger buffer with a black border of at least
+ * guard pixels on every side, candidates whose samples stay within the
+ * border are read without checking the image bounds.  If plane holds the
+ * same image bit-packed, the bulls-eye is measured from it a word at a
+ * time.  If expected is set, the candidate only decodes if its best
+ * reading is one of those codes.
+ */
+  int decode(cv::Mat &image, int guard = 0, BitPlane *plane = NULL,
+             const CodeSet *expected = NULL);
+
+/*
+ * Decodes a candidate where previous, the same code in an earlier frame,
+ * was found: the candidate is centered as in decode, then read once at
+ * previous's unit and orientation instead of sweeping units and arcs.
+ * Returns the code if that reading gives previous's code again, about as
+ * confidently as before, otherwise 0 with the candidate left as it was
+ * for a full decode.
+ */
+  int decodeFrom(cv::Mat &image, const TopCode &previous, int guard = 0,
+                 BitPlane *plane = NULL, const CodeSet *expected = NULL);
+
+/*
+ * Quick check that a candidate looks like a bulls-eye before decoding it:
+ * a white center, and a black and a white ring at 8 compass points, one
+ * and a half and two and a half units out.  Uses the current center and
+ * unit estimate; returns 0 if too many of the 17 pixels are wrong.
+ */
+  int probe(cv::Mat &image);
+
+/*
+ * Decodes n candidates, several at a time in vector lanes where the CPU
+ * supports it.  Gives the same results as calling decode on each one.
+ */
+  static void decodeBatch(cv::Mat &image, TopCode **codes, int n, int guard = 0,
+                          BitPlane *plane = NULL, const CodeSet *expected = NULL);
 
   std::string toJSON();
 
+/*
+ * Appends the same JSON object to json, which can keep its capacity from
+ * frame to frame
+ */
+  void appendJSON(std::string &json);
+
 private:
 
-  int readCode(cv::Mat &image, double arca);
+  /* Score of the reading the code was decoded from, 0 if not decoded */
+  int _score;
+
+  void locate(cv::Mat &image, BitPlane *plane);
+
+  int inGuard(cv::Mat &image, int guard);
+
+  int sweepArcs(cv::Mat &image, double &maxa, int checked);
+
+  int readCode(cv::Mat &image, int arc, int checked);
 
   int rotateLowest(int bits, double arca);
 
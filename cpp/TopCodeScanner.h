@@ -21,35 +21,362 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 #import <opencv2/highgui/highgui.hpp>
+#import "BitPlane.h"
+#import "TopCode.h"
 #include <vector>
+#include <string>
+#include <stdint.h>
 
-class TopCode;
+/*
+ * Hears about the codes found by TopCodeScanner::scan as they are found,
+ * rather than when the whole frame is done
+ */
+class ScanListener {
+
+public:
+
+  virtual ~ScanListener() {}
+
+/*
+ * Start finding codes
+ */
+  virtual void onBegin() {}
+
+/*
+ * New code found, in full resolution coordinates.  The code belongs to
+ * the scanner and also appears in the list scan returns.  A non-zero
+ * return value stops the scan: no more codes are decoded or reported.
+ */
+  virtual int onNewCode(TopCode *code) = 0;
+
+/*
+ * Finished finding codes, also when onNewCode stopped the scan
+ */
+  virtual void onEnd() {}
+
+};
 
 class TopCodeScanner {
 
 public:
 
-  TopCodeScanner();
+/*
+ * How the image is binarized before looking for bulls-eyes.  WELLNER
+ * compares each pixel to a running average along its row; INTEGRAL
+ * compares it to the mean of a square window around it taken from a
+ * summed-area table, so the result does not depend on scan order.
+ */
+  enum ThresholdMode {
+    WELLNER,
+    INTEGRAL
+  };
+
+  TopCodeScanner(ThresholdMode mode = WELLNER);
 
   ~TopCodeScanner();
 
 /*
- * Scans a bitmap and returns a list of TopCode objects contained in the image
+ * Scans a bitmap and returns a list of TopCode objects contained in the image.
+ * If a listener is given, it is told about each code as soon as it is
+ * accepted, and can stop the scan early; the list then holds the codes
+ * found up to that point.
+ * If a budget (in milliseconds) is given, the bulls-eyes are decoded most
+ * promising first: where the last scan found codes, then those confirmed
+ * by the most runs.  Once the time is up only the places of codes from
+ * the last scan (see setTracking) are still decoded, one candidate for
+ * each code at each level, and a level begun after it only looks around
+ * them; the list holds the codes found so far and isTruncated() is set.
+ * The image is left binarized (outside the mask, if any, or outside the
+ * areas a late level looked at, it is left as it was), unless the unit
+ * range leaves out units up to PYRAMID_UNIT: then only the half
+ * resolution copy is scanned and the image is not touched at all.  The
+ * codes are not drawn on it, which is up to the caller (TopCode::draw).
  */
-  std::vector<TopCode *> *scan(cv::Mat &image);
+  std::vector<TopCode *> *scan(cv::Mat &image, ScanListener *listener = NULL,
+                               double budget = 0);
 
 /*
- * Release memory used to store topcodes after each scan
+ * A place to decode at, from a tracker or another detector.  (x, y)
+ * should fall in the white center of the bulls-eye; unit is the expected
+ * ring width in pixels, or 0 if it is not known.
+ */
+  struct Seed {
+    double x, y;
+    double unit;
+  };
+
+/*
+ * Decodes around the given seeds only, instead of scanning the whole
+ * image: each seed gets a window just large enough for a code of its
+ * unit (or of the largest unit in the range, SEED_UNIT without one),
+ * binarized on its own and decoded, the seeds in parallel.  Windows are
+ * binarized like the INTEGRAL threshold, which gives the same pixels in
+ * a window as over the whole image, and large units are decoded at half
+ * resolution as in a scan.  Seeds outside the mask are skipped.  Returns
+ * the valid codes in seed order, one per code where seeds share one; the
+ * image is not changed.
+ */
+  std::vector<TopCode *> *decodeSeeds(cv::Mat &image, const std::vector<Seed> &seeds);
+
+/*
+ * Release the topcodes from the last scan.  They are kept for reuse by
+ * the next scan rather than deleted.
  */
   void cleanup();   
 
+/*
+ * Expected range of TopCode unit sizes (ring width) in pixels.  Codes with
+ * units above PYRAMID_UNIT are searched for in a half resolution copy of
+ * the image first, and their areas are skipped at full resolution; full
+ * resolution is only processed at all if the range includes small units.
+ * Passing 0 for maxUnit scans a single level with no upper limit.
+ */
+  void setUnitRange(double minUnit, double maxUnit);
+
+/*
+ * Codes the scan and decodeSeeds look for.  Anything else they decode is
+ * dropped, so stray patterns that happen to read as some other code stay
+ * out of the results.  An empty list (the default) accepts every valid
+ * code.  This only filters: every candidate is still decoded in full, so
+ * a short list does not make the scan any faster.
+ */
+  void setExpectedCodes(const std::vector<int> &codes);
+
+/*
+ * Restricts scan to part of the camera's view, such as the table, so the
+ * rest of every frame is never thresholded, searched or decoded.  mask
+ * has non-zero pixels where codes can be, and is scaled to the frame if
+ * its size differs.  Codes must lie wholly inside the mask: what is
+ * outside reads as black.
+ */
+  void setMask(const cv::Mat &mask);
+
+/*
+ * The same for the inside of a polygon, in frame pixels
+ */
+  void setMask(const std::vector<cv::Point> &polygon);
+
+/*
+ * Reads a mask from a file: an image, or text with one "x y" polygon
+ * vertex per line.  Returns 0 (and leaves the mask as it was) if the
+ * file cannot be read.
+ */
+  int loadMask(const std::string &path);
+
+  void clearMask();
+
+/*
+ * Whether scan decodes candidates near the codes of the previous scan
+ * with the unit and orientation those had first (on by default).  A
+ * candidate within a unit of a code's center gets a single reading as
+ * that code, and only if it does not confidently read as the same code
+ * again the full decode.  For a sequence of frames from one camera.
+ */
+  void setTracking(int tracking);
+
+/*
+ * Number of horizontal bulls-eye runs found by the last scan, how many
+ * of those were confirmed by a vertical run, and how many bulls-eyes
+ * they were collapsed into and passed to decode
+ */
+  int getCandidateCount() { return _candidateCount; }
+
+  int getConfirmedCount() { return _confirmedCount; }
+
+  int getSeedCount() { return _seedCount; }
+
+/*
+ * Number of bulls-eyes from the last scan that failed TopCode::probe and
+ * were dropped without a full decode
+ */
+  int getRejectedCount() { return _rejectedCount; }
+
+/*
+ * Number of codes from the last scan read with the unit and orientation
+ * of a code from the scan before
+ */
+  int getTrackedCount() { return _trackedCount; }
+
+/*
+ * Whether the last scan ran out of its time budget before decoding all
+ * of its bulls-eyes
+ */
+  int isTruncated() { return _truncated; }
+
 private:
 
+  ThresholdMode _mode;
+
   std::vector<TopCode *> _codes;
 
   std::vector<TopCode *> _candidates;
 
-  void threshold(cv::Mat &image);
+  /* Number of confirmed runs behind each candidate */
+  std::vector<int> _evidence;
+
+  /* A candidate and where it comes in the order of decoding under a
+     time budget: higher priority first, then in the order found */
+  struct Ranked {
+    int priority;
+    int index;
+    TopCode *top;
+    bool operator<(const Ranked &other) const {
+      return (priority != other.priority) ? priority > other.priority : index < other.index;
+    }
+  };
+
+  std::vector<Ranked> _ranked;
+
+  /* Released TopCode objects, reused by later scans so that a scan in
+     steady state does not allocate */
+  std::vector<TopCode *> _free;
+
+  /* Bit-packed candidate bitmap, one bit per pixel, _words per row */
+  std::vector<uint64_t> _hmask;
+  int _words;
+
+  /* A confirmed bulls-eye pixel and the length of its vertical
+     black-white-black run */
+  struct Mark {
+    int x, y, span;
+  };
+
+  /* Marks merged into one bulls-eye. Runs of marks are merged
+     row by row; parent links clusters that turned out to touch */
+  struct Cluster {
+    int parent;
+    int x0, x1, row;
+    int count, maxspan;
+    double sumx, sumy;
+  };
+
+  std::vector<Mark> _marks;
+
+  std::vector<Cluster> _clusters;
+
+  /* Clusters whose last run is close enough to join the next row's */
+  std::vector<int> _active;
+
+  int _candidateCount;
+  int _confirmedCount;
+  int _seedCount;
+  int _rejectedCount;
+  int _trackedCount;
+
+  /* Listener of the scan in progress, and whether it asked to stop */
+  ScanListener *_listener;
+  bool _stopped;
+
+  /* End of the time budget of the scan in progress in ticks (0 for
+     none), and whether it was reached */
+  int64_t _deadline;
+  bool _truncated;
+
+  /* Expected unit range, and the bulls-eye run lengths accepted at the
+     level being scanned */
+  double _minUnit, _maxUnit;
+  int _minRun, _maxRun;
+
+  /* Codes looked for, or empty for all of them */
+  CodeSet _expected;
+
+  /* Codes of the previous scan, in full resolution coordinates, if
+     tracking: copies, as the scan reuses the TopCodes themselves */
+  int _tracking;
+  std::vector<TopCode> _previous;
+
+  /* Codes of _previous whose place a candidate past the deadline has
+     been decoded at, in the level being scanned */
+  std::vector<unsigned char> _claimed;
+
+  /* The mask as given, either a bitmap or a polygon (both empty for no
+     mask), and the frame size the spans were last made for */
+  cv::Mat _mask;
+  std::vector<cv::Point> _polygon;
+  cv::Size _spanSize;
+
+  /* Unmasked columns of each row of a pyramid level: row i has the
+     spans from x[2k] to x[2k+1] (exclusive) for k from row[i] up to
+     row[i+1].  Rows before top and from bottom on have none, and all
+     spans lie between columns left and right. */
+  struct Spans {
+    std::vector<int> row;
+    std::vector<int> x;
+    int top, bottom;
+    int left, right;
+  };
+
+  Spans _spans[2];
+
+  /* Spans around the codes of the last scan, for a level begun past the
+     deadline, and the squares they are made from */
+  Spans _near;
+  std::vector<cv::Rect> _boxes;
+
+  /* Half resolution copy of the image for large codes */
+  cv::Mat _half;
+
+  /* Binarized copy of each level inside a black border of GUARD pixels,
+     and the view of the image within it that is decoded, so that decode
+     can sample past the edges of the image without bounds checks */
+  cv::Mat _padded[2];
+  cv::Mat _binary;
+
+  /* Bit-packed view of _binary, for the run lengths measured by confirm
+     and decode */
+  BitPlane _plane;
+
+  /* Summed-area table for the INTEGRAL threshold, (rows+1) x (cols+1) */
+  std::vector<uint32_t> _integral;
+
+  /* Summed-area table and binarized copy (inside a GUARD border) of the
+     window around one seed, and its half resolution pixels for large
+     units, one per thread */
+  struct SeedWindow {
+    std::vector<uint32_t> integral;
+    std::vector<uchar> binary;
+    std::vector<uchar> half;
+  };
+
+  std::vector<SeedWindow> _windows;
+
+  TopCode *newCode(double x, double y);
+
+  void freeCode(TopCode *top);
+
+  const TopCode *previousAt(double x, double y);
+
+  void rank(double scale);
+
+  bool pastDeadline();
+
+  void decodeSeed(cv::Mat &image, const Seed &seed, SeedWindow &window, TopCode *top);
+
+  void scanLevel(cv::Mat &image, int level, double minUnit, double maxUnit);
+
+  void makeSpans(cv::Mat &image);
+
+  static void listSpans(const cv::Mat &mask, Spans &spans);
+
+  int inMask(double x, double y);
+
+  void nearPrevious(int level, Spans &near);
+
+  void maskCodes(cv::Mat &image);
+
+  void threshold(cv::Mat &image, const Spans &spans);
+
+  void thresholdWellner(cv::Mat &image, const Spans &spans);
+
+  void thresholdIntegral(cv::Mat &image, const Spans &spans);
+
+  void integrate(cv::Mat &image, int top, int bottom, int left, int right);
+
+  void confirm(cv::Mat &image, const Spans &spans);
+
+  void cluster();
+
+  int findCluster(int c);
 
 };
 
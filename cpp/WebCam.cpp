@@ -25,11 +25,17 @@
 #include <opencv2/imgproc/imgproc.hpp>
  
 #include <iostream>
+#include <algorithm>
+#include <new>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "TopCode.h"
 #include "TopCodeScanner.h"
+#include "FramePool.h"
+#include "Snapshot.h"
 #include "easywsclient.h"
  
 using namespace std;
@@ -37,35 +43,385 @@ using namespace cv;
 using easywsclient::WebSocket;
 
 
+/* Frames between --stats reports */
+const int STATS_FRAMES = 100;
+
+/* Default rate of the preview window, in frames per second */
+const int PREVIEW_FPS = 5;
+
+/* Number of valid codes, which TopCode::getIndex numbers from 0 */
+const int CODES = 99;
+
+
+#ifdef TOPCODES_COUNT_ALLOCS
+
+/*
+ * Built with TOPCODES_COUNT_ALLOCS, every call to operator new and every
+ * matrix buffer OpenCV allocates is counted, so that --stats can show
+ * that the capture loop no longer allocates once it is running
+ */
+static long allocations = 0;
+static long matAllocations = 0;
+
+static void *countedMalloc(size_t size) {
+  __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+  if (size == 0) size = 1;
+  for (;;) {
+    void *p = malloc(size);
+    if (p != NULL) return p;
+    std::new_handler handler = std::set_new_handler(NULL);
+    std::set_new_handler(handler);
+    if (handler == NULL) throw std::bad_alloc();
+    handler();
+  }
+}
+
+void *operator new(size_t size) {
+  return countedMalloc(size);
+}
+
+void *operator new[](size_t size) {
+  return countedMalloc(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  try {
+    return countedMalloc(size);
+  } catch (...) {
+    return NULL;
+  }
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  try {
+    return countedMalloc(size);
+  } catch (...) {
+    return NULL;
+  }
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+  free(p);
+}
+
+#if defined(__cpp_aligned_new)
+static void *countedAlignedMalloc(size_t size, std::align_val_t align) {
+  __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+  if (size == 0) size = 1;
+  size_t alignment = std::max((size_t)align, sizeof(void *));
+  for (;;) {
+    void *p = NULL;
+    if (posix_memalign(&p, alignment, size) == 0) return p;
+    std::new_handler handler = std::set_new_handler(NULL);
+    std::set_new_handler(handler);
+    if (handler == NULL) throw std::bad_alloc();
+    handler();
+  }
+}
+
+void *operator new(size_t size, std::align_val_t align) {
+  return countedAlignedMalloc(size, align);
+}
+
+void *operator new[](size_t size, std::align_val_t align) {
+  return countedAlignedMalloc(size, align);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept {
+  free(p);
+}
+#endif
+
+
+/*
+ * Matrix buffers come from cv::fastMalloc rather than operator new, so
+ * they are counted by the default matrix allocator, which leaves the
+ * work to OpenCV's own.  A frame buffer the camera or cvtColor has to
+ * reallocate shows up here.
+ */
+#if CV_VERSION_MAJOR >= 4
+typedef AccessFlag MatAccess;
+#else
+typedef int MatAccess;
+#endif
+
+class CountingMatAllocator : public MatAllocator {
+
+public:
+
+  UMatData *allocate(int dims, const int *sizes, int type, void *data,
+                     size_t *step, MatAccess flags, UMatUsageFlags usage) const {
+    if (data == NULL) __atomic_fetch_add(&matAllocations, 1, __ATOMIC_RELAXED);
+    return Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usage);
+  }
+
+  bool allocate(UMatData *u, MatAccess flags, UMatUsageFlags usage) const {
+    return Mat::getStdAllocator()->allocate(u, flags, usage);
+  }
+
+  void deallocate(UMatData *u) const {
+    Mat::getStdAllocator()->deallocate(u);
+  }
+};
+
+static CountingMatAllocator matAllocator;
+
+#endif
+
+
 
 void handle_message(const std::string & message)
 {
     printf(">>> %s\n", message.c_str());
 }
 
+
+/*
+ * Writes the codes of a frame into a JSON array as the scanner finds
+ * them, and sends the array through the websocket when the scan ends.
+ * If some codes are expected, the scan stops as soon as all of them have
+ * been found.
+ */
+class Publisher : public ScanListener {
+
+public:
+
+  WebSocket *socket;
+
+  /* Expected codes by index, and how many there are (0 for none) */
+  char expected[CODES];
+  int expectedCount;
+
+  Publisher() {
+    socket = NULL;
+    memset(expected, 0, sizeof(expected));
+    expectedCount = 0;
+  }
+
+  void expect(int code) {
+    TopCode top;
+    top.code = code;
+    int k = top.getIndex();
+    if (k >= 0 && !expected[k]) {
+      expected[k] = 1;
+      expectedCount++;
+    }
+  }
+
+  void onBegin() {
+    json.clear();
+    json += "[\n";
+    memset(seen, 0, sizeof(seen));
+    seenCount = 0;
+  }
+
+  int onNewCode(TopCode *code) {
+    json += "   ";
+    code->appendJSON(json);
+    json += ",\n";
+
+    int k = code->getIndex();
+    if (expectedCount > 0 && k >= 0 && expected[k] && !seen[k]) {
+      seen[k] = 1;
+      if (++seenCount == expectedCount) return 1;  // all found: stop
+    }
+    return 0;
+  }
+
+  void onEnd() {
+    json += "]";
+    if (socket) {
+      socket->send(json);
+      socket->poll();
+      socket->dispatch(handle_message);
+    }
+  }
+
+private:
+
+  string json;
+  char seen[CODES];
+  int seenCount;
+
+};
+
+
+/*
+ * Reads a comma-separated list of codes, stopping at anything else
+ */
+static void parseCodes(const char *list, vector<int> &codes)
+{
+  for (const char *p = list; p != NULL && *p; ) {
+    char *end;
+    long code = strtol(p, &end, 10);
+    if (end == p) break;
+    codes.push_back((int)code);
+    p = (*end == ',') ? end + 1 : end;
+  }
+}
+
+
+/*
+ * Everything the capture loop works with, shared with the preview on the
+ * main thread
+ */
+struct Capture {
+  VideoCapture *camera;
+  TopCodeScanner scanner;
+  Publisher publisher;
+  FramePool *pool;
+  Snapshot *snapshot;     // NULL when headless
+  double budget;          // time budget of a scan in milliseconds, 0 for none
+  int stats;
+  int stop;               // set by the preview to end the capture loop
+  int done;               // set by the capture loop when it ends
+};
+
+
+/*
+ * Reads, scans and sends frames until the camera stops or the preview
+ * asks to stop.  No HighGUI calls: the latest frame and its codes are
+ * handed to the preview through the snapshot, and only when the preview
+ * has taken the one before.
+ */
+static void *captureLoop(void *arg)
+{
+  Capture &capture = *(Capture *)arg;
+  FramePool &pool = *capture.pool;
+
+  // the frame buffers are set up once the first frame gives their size,
+  // and after that every frame is read, flipped and converted in place
+  long frames = 0;
+  long reallocations = 0;
+  long truncated = 0;
+#ifdef TOPCODES_COUNT_ALLOCS
+  long counted = allocations;
+  long matCounted = matAllocations;
+#endif
+
+  while (!__atomic_load_n(&capture.stop, __ATOMIC_ACQUIRE))
+  {
+    FramePool::Frame &frame = pool.next();
+
+    // capture the next still video frame
+    if (!capture.camera->read(frame.capture)) break;
+
+    // flip the image horizontally so that it gives you a mirror reflection
+    flip(frame.capture, frame.mirror, 1);
+
+    // convert to greyscale
+    cvtColor(frame.mirror, frame.grey, CV_RGB2GRAY);
+
+    // scan for topcodes, which the publisher writes out as they are found
+    // and sends through the websocket
+    vector<TopCode*> *codes = capture.scanner.scan(frame.grey, &capture.publisher, capture.budget);
+    if (capture.scanner.isTruncated()) truncated++;
+
+    // hand the frame to the preview if it is ready for another one
+    if (capture.snapshot && capture.snapshot->wanted()) {
+      capture.snapshot->publish(frame.grey, *codes, frames);
+    }
+
+    // OpenCV allocated new buffers for this frame (the first one, or the
+    // camera changed size): move the pool over to the new size
+    if (!pool.owns(frame)) {
+      reallocations++;
+      pool.reserve(frame.capture.rows, frame.capture.cols, frame.capture.type());
+    }
+
+    frames++;
+    if (capture.stats && frames % STATS_FRAMES == 0) {
+      cerr << frames << " frames: ";
+#ifdef TOPCODES_COUNT_ALLOCS
+      cerr << (allocations - counted) / (double)STATS_FRAMES << " heap and "
+           << (matAllocations - matCounted) / (double)STATS_FRAMES << " matrix allocations per frame, ";
+      counted = allocations;
+      matCounted = matAllocations;
+#endif
+      cerr << reallocations << " buffer reallocations"
+           << (pool.usesHugePages() ? ", huge pages" : "");
+      if (capture.budget > 0) cerr << ", " << truncated << " scans over budget";
+      cerr << endl;
+      reallocations = 0;
+      truncated = 0;
+    }
+  }
+
+  __atomic_store_n(&capture.done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
  
 int main( int argc, const char** argv )
 {
 
   int camera_number = 0;
-  char socket_url[512];
-  TopCodeScanner scanner;
-  WebSocket *socket = NULL;
+  const char *args[2] = { NULL, "ws://localhost:8126/topcodes" };
+  int nargs = 0;
+  int stats = 0;
+  int huge_pages = 0;
+  int headless = 0;
+  int preview_fps = PREVIEW_FPS;
+  double budget = 0;
+  const char *expect = NULL;
+  const char *only = NULL;
+  const char *mask = NULL;
 
-  if (argc < 2) {
-    cerr << "expected: " << argv[0] << " <camera_number> [socket server]" << endl;
+  // options first, then the camera number and socket server
+  for (int i=1; i<argc; i++) {
+    if (strcmp(argv[i], "--stats") == 0) {
+      stats = 1;
+    } else if (strcmp(argv[i], "--huge-pages") == 0) {
+      huge_pages = 1;
+    } else if (strcmp(argv[i], "--headless") == 0) {
+      headless = 1;
+    } else if (strcmp(argv[i], "--preview-fps") == 0 && i + 1 < argc) {
+      preview_fps = std::max(1, atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--expect") == 0 && i + 1 < argc) {
+      expect = argv[++i];
+    } else if (strcmp(argv[i], "--only") == 0 && i + 1 < argc) {
+      only = argv[++i];
+    } else if (strcmp(argv[i], "--mask") == 0 && i + 1 < argc) {
+      mask = argv[++i];
+    } else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+      budget = std::max(0.0, atof(argv[++i]));
+    } else if (nargs < 2) {
+      args[nargs++] = argv[i];
+    }
+  }
+
+  if (nargs < 1) {
+    cerr << "expected: " << argv[0] << " [--headless] [--preview-fps <fps>] [--expect <code,code,...>]" << endl;
+    cerr << "              [--only <code,code,...>] [--mask <file>] [--budget <ms>] [--stats]" << endl;
+    cerr << "              [--huge-pages]" << endl;
+    cerr << "              <camera_number> [socket server]" << endl;
     cerr << "    example: > topcodes 0 ws://localhost:8126/topcodes" << endl;
     return -1;
   }
 
   // get the camera number
-  camera_number = atoi(argv[1]);  // 0 if error
+  camera_number = atoi(args[0]);  // 0 if error
 
-  if (argc >= 3) {
-    socket = WebSocket::from_url(argv[2]);
-  } else {
-    socket = WebSocket::from_url("ws://localhost:8126/topcodes");
-  }
+#ifdef TOPCODES_COUNT_ALLOCS
+  // count the matrix buffers, which bypass operator new
+  Mat::setDefaultAllocator(&matAllocator);
+#endif
 
   // open the default camera  
   VideoCapture cap(camera_number); 
@@ -73,42 +429,64 @@ int main( int argc, const char** argv )
     cerr << "Error: Unable to open webcam " << camera_number << endl;
     return -1;
   }
- 
-  for(;;)
-  {
-    Mat frame, grey, flipped;
 
-    // capture the next still video frame
-    cap >> frame; 
+  FramePool pool(3, huge_pages);
+  Snapshot snapshot;
+  Capture capture;
+  capture.camera = &cap;
+  capture.publisher.socket = WebSocket::from_url(args[1]);
+  capture.pool = &pool;
+  capture.snapshot = headless ? NULL : &snapshot;
+  capture.budget = budget;
+  capture.stats = stats;
+  capture.stop = 0;
+  capture.done = 0;
 
-    // flip the image horizontally so that it gives you a mirror reflection
-    flip(frame, flipped, 1);
+  // codes that end the scan of a frame once all are found
+  vector<int> codes;
+  parseCodes(expect, codes);
+  for (int i=0; i<codes.size(); i++) {
+    capture.publisher.expect(codes[i]);
+  }
 
-    // convert to greyscale
-    cvtColor(flipped, grey, CV_RGB2GRAY);
+  // the only codes the scanner reads at all
+  codes.clear();
+  parseCodes(only, codes);
+  capture.scanner.setExpectedCodes(codes);
 
-    // scan for topcodes
-    vector<TopCode*> *codes = scanner.scan(grey);
+  // the part of the view to scan
+  if (mask != NULL && !capture.scanner.loadMask(mask)) {
+    cerr << "Error: Unable to read the mask " << mask << endl;
+    return -1;
+  }
 
-    // send topcode info through the websocket
-    if (socket) {
-      string json = "[\n";
-      for (int i=0; i<codes->size(); i++) {
-        TopCode *code = (*codes)[i];
-        json += ("   " + code->toJSON() + ",\n");
-      }
-      json += "]";
-      socket->send(json);
-      socket->poll();
-      socket->dispatch(handle_message);
+  if (headless) {
+    captureLoop(&capture);
+  } else {
+    // HighGUI has to stay on the main thread (macOS insists), so the
+    // capture loop gets its own thread and the preview polls the snapshot
+    // at its own rate
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, captureLoop, &capture) != 0) {
+      cerr << "Error: Unable to start the capture thread" << endl;
+      return -1;
     }
+    while (!__atomic_load_n(&capture.done, __ATOMIC_ACQUIRE)) {
+      Snapshot::Frame *latest = snapshot.take();
+      if (latest != NULL) {
+        for (int i=0; i<latest->codes.size(); i++) {
+          latest->codes[i].draw(latest->image);
+        }
+        // show the resulting image (debuggin)
+        imshow("webcam", latest->image);
+      }
 
-    // show the resulting image (debuggin)
-    imshow("webcam", grey);
-
-    // press the 'q' key to quit
-    if (waitKey(30) >= 0) break;
+      // press the 'q' key to quit
+      if (waitKey(1000 / preview_fps) >= 0) break;
+    }
+    __atomic_store_n(&capture.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
   }
 
-  if (socket) delete socket;
+  if (capture.publisher.socket) delete capture.publisher.socket;
 }
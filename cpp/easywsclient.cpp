@@ -365,8 +365,9 @@ class _RealWebSocket : public easywsclient::WebSocket
         const uint8_t masking_key[4] = { 0x12, 0x34, 0x56, 0x78 };
         // TODO: consider acquiring a lock on txbuf...
         if (readyState == CLOSING || readyState == CLOSED) { return; }
-        std::vector<uint8_t> header;
-        header.assign(2 + (message_size >= 126 ? 2 : 0) + (message_size >= 65536 ? 6 : 0) + (useMask ? 4 : 0), 0);
+        // a fixed array, so that sending does not allocate once txbuf has grown
+        uint8_t header[14] = { 0 };
+        size_t header_size = 2 + (message_size >= 126 ? 2 : 0) + (message_size >= 65536 ? 6 : 0) + (useMask ? 4 : 0);
         header[0] = 0x80 | type;
         if (false) { }
         else if (message_size < 126) {
@@ -407,7 +408,7 @@ class _RealWebSocket : public easywsclient::WebSocket
             }
         }
         // N.B. - txbuf will keep growing until it can be transmitted over the socket:
-        txbuf.insert(txbuf.end(), header.begin(), header.end());
+        txbuf.insert(txbuf.end(), header, header + header_size);
         txbuf.insert(txbuf.end(), message_begin, message_end);
         if (useMask) {
             for (size_t i = 0; i != message_size; ++i) { *(txbuf.end() - message_size + i) ^= masking_key[i&0x3]; }